@@ -1,18 +1,61 @@
 #include <taglib/fileref.h>
 #include <taglib/tag.h>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+// Linux-only extras: FIEMAP ordering for the prefetch, ioprio, perf syscall
+// counts in the bench, inotify for --watch. Elsewhere they fall back or are off.
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+#if MP3FLAC_IO_URING
+#include <linux/io_uring.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <csignal>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -46,6 +89,37 @@ static bool parse_bool(std::string s, bool def=false) {
   return (s == "1" || s == "true" || s == "yes" || s == "on");
 }
 
+// Case-insensitive match of the file name's extension against `ext_lower`, done in
+// place on the path string (same answer as lowercasing path::extension()).
+static bool has_ext(const fs::path &p, std::string_view ext_lower) {
+  std::string_view s = p.native();
+  if (s.size() <= ext_lower.size()) return false;
+  const std::size_t pos = s.size() - ext_lower.size();
+  // A dot file such as "dir/.mp3" has no extension.
+  if (s[pos - 1] == '/') return false;
+  for (std::size_t i = 0; i < ext_lower.size(); ++i) {
+    if (std::tolower(static_cast<unsigned char>(s[pos + i])) != ext_lower[i]) return false;
+  }
+  return true;
+}
+
+// lexically_normal() without the trailing separator it keeps for "dir/".
+static fs::path normal_dir(const fs::path &p) {
+  fs::path n = p.lexically_normal();
+  if (!n.has_filename() && n.has_relative_path()) n = n.parent_path();
+  return n;
+}
+
+// st_mtime with nanoseconds (macOS names the field st_mtimespec).
+static std::int64_t stat_mtime_ns(const struct stat &st) {
+#ifdef __APPLE__
+  const struct timespec &ts = st.st_mtimespec;
+#else
+  const struct timespec &ts = st.st_mtim;
+#endif
+  return static_cast<std::int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
 static std::string sanitize_component(std::string s) {
   s = trim(s);
   if (s.empty()) return "Unknown";
@@ -72,6 +146,69 @@ static std::string sanitize_component(std::string s) {
   return out;
 }
 
+// ---- categories and media types ----
+//
+// The index categories and media types are fixed at compile time. Config values
+// are parsed into a CategoryMask once, and the per-release code switches on the
+// enum instead of comparing names. A new category is an enum value, a row in
+// kCategoryNames and a case in category_value().
+
+enum class Category : std::uint8_t { Alpha, Genre, Year, Artist, Album, Groups, Bitrate, Format, Length, kCount };
+
+using CategoryMask = std::uint32_t;
+
+static constexpr std::size_t kNumCategories = static_cast<std::size_t>(Category::kCount);
+
+constexpr CategoryMask category_bit(Category c) { return CategoryMask{1} << static_cast<unsigned>(c); }
+
+// Directory name per category, in enum order.
+static constexpr const char *kCategoryDirs[] = {"alpha",  "genre",   "year",   "artist", "album",
+                                                "groups", "bitrate", "format", "length"};
+static_assert(std::size(kCategoryDirs) == kNumCategories);
+
+// Categories taken from the audio properties instead of the tags.
+static constexpr CategoryMask kAudioCategories =
+    category_bit(Category::Bitrate) | category_bit(Category::Format) | category_bit(Category::Length);
+
+// Names accepted in MP3_INDEXES/FLAC_INDEXES ("group" is an alias of "groups").
+static constexpr std::pair<const char *, Category> kCategoryNames[] = {
+    {"alpha", Category::Alpha}, {"genre", Category::Genre}, {"year", Category::Year},   {"artist", Category::Artist},
+    {"album", Category::Album}, {"groups", Category::Groups}, {"group", Category::Groups},
+    {"bitrate", Category::Bitrate}, {"format", Category::Format}, {"length", Category::Length},
+};
+
+static CategoryMask parse_categories(const std::string &csv, const char *key) {
+  CategoryMask mask = 0;
+  for (const std::string &name : split_csv(csv)) {
+    auto it = std::find_if(std::begin(kCategoryNames), std::end(kCategoryNames),
+                           [&](const auto &n) { return name == n.first; });
+    if (it == std::end(kCategoryNames)) {
+      std::cerr << "[warn] " << key << ": unknown index ignored: " << name << "\n";
+      continue;
+    }
+    mask |= category_bit(it->second);
+  }
+  return mask;
+}
+
+enum class MediaType : std::uint8_t { Mp3, Flac };
+
+struct MediaTypeInfo {
+  MediaType media;
+  const char *name;
+  const char *ext;
+};
+
+static constexpr MediaTypeInfo kMediaTypes[] = {
+    {MediaType::Mp3, "mp3", ".mp3"},
+    {MediaType::Flac, "flac", ".flac"},
+};
+
+static unsigned hardware_threads() {
+  const unsigned hw = std::thread::hardware_concurrency();
+  return hw > 0 ? hw : 1;
+}
+
 struct Config {
   // Backwards compatible: MUSIC_DIR can be used for both types.
   std::vector<fs::path> music_dirs;
@@ -81,10 +218,73 @@ struct Config {
   fs::path index_root;
   bool relative_symlinks = false;
   bool clean_on_start = false;
+  // When cleaning, build each category in a staging sibling and swap it in at the
+  // end instead of emptying the live tree first.
+  bool atomic_rebuild = false;
+  // Write <INDEX_ROOT>/<type>.catalog after each run.
+  bool catalog = false;
+  // Diff the index tree against the scan and apply only the changes, removing
+  // links of releases that are gone.
+  bool reconcile = false;
   bool follow_symlinks = false;
+  // Remember per-release tags in <INDEX_ROOT>/.mp3flac-state/<type>.state and
+  // skip the tag read on re-runs when the release is unchanged on disk.
+  bool incremental = false;
+  // Where to write run metrics (JSON summary / Prometheus textfile); empty = off.
+  fs::path metrics_json;
+  fs::path metrics_prom;
+  // Progress file rewritten every status_secs while running (see StatusReporter).
+  fs::path status_json;
+  int status_secs = 2;
+  // --watch: quiet time after the last event before a release is (re-)indexed.
+  int watch_debounce_ms = 1000;
+  // I/O governor (see IoGovernor); 0 / false = off.
+  int tag_read_iops = 0;
+  std::uint64_t tag_read_bytes = 0;
+  int tag_read_latency_ms = 0;
+  bool ioprio_idle = false;
+  // Only walk date directories of the last N days (see ScanWindow); 0 = all.
+  int scan_window_days = 0;
+  // Seconds between scan checkpoints (see --resume); 0 = none.
+  int checkpoint_secs = 60;
+  // Tag-reading worker threads, default one per hardware thread; 1 reads inline
+  // on the walking thread.
+  unsigned threads = hardware_threads();
+  // Directory listing threads for the walk; 1 walks on the scanning thread.
+  unsigned walk_threads = 1;
+  // Symlink writer shards (threads); 1 creates links inline.
+  unsigned link_writers = 1;
+  // Write link operations to this manifest instead of the index tree, and the
+  // command (e.g. ssh to the index host running `apply-links`) fed it on stdin.
+  fs::path link_manifest;
+  std::string link_apply;
+  // Shard mode: scan this node's roots without writing links and leave a partial
+  // (<INDEX_ROOT>/<type>.<shard>.partial) for `merge` on the index host. Release
+  // paths in it are rewritten LOCAL -> INDEX by SHARD_PATH_MAP (longest prefix).
+  std::string shard;
+  std::vector<std::pair<std::string, std::string>> shard_path_map;
+  // Parse ID3v2 / FLAC VORBIS_COMMENT directly and only open the file with TagLib
+  // when the fast reader can't decide.
+  bool fast_tags = true;
+  // Audio files per release whose tags are compared (majority per field).
+  unsigned tag_samples = 1;
+  // Keep tags by file identity in <INDEX_ROOT>/.mp3flac-state/tags.cache so moved
+  // or copied releases are not read again.
+  bool tag_cache = false;
+  // Releases the prefetch thread works ahead of the readers (0 = off), and how
+  // much of each candidate file's head it asks the kernel for.
+  std::size_t prefetch_distance = 0;
+  std::size_t prefetch_kb = 64;
+  // Split a category value directory into buckets once it holds more than this
+  // many releases (0 = never); FANOUT=alpha|hash picks first letter or hash prefix.
+  std::size_t fanout_threshold = 0;
+  bool fanout_hash = false;
   std::vector<std::string> enable_types = {"mp3", "flac"};
-  std::vector<std::string> mp3_indexes = {"alpha", "genre", "year", "groups"};
-  std::vector<std::string> flac_indexes = {"alpha", "genre", "groups", "year"};
+  CategoryMask mp3_indexes = category_bit(Category::Alpha) | category_bit(Category::Genre) |
+                             category_bit(Category::Year) | category_bit(Category::Groups);
+  CategoryMask flac_indexes = mp3_indexes;
+  // A bitrate/format/length index is enabled, so audio properties are read too.
+  bool audio_props = false;
 
   // How many directory levels below the scan root define a "release".
   // Example layout: /site/recent/mp3/YYYY-MM-DD/<release>/... => depth=2
@@ -140,7 +340,8 @@ static Config load_config(const fs::path &cfg_path) {
   }
 
   if (kv.count("index_root") && !kv["index_root"].empty()) {
-    cfg.index_root = fs::path(kv["index_root"].back());
+    // Link paths are built from it and compared by prefix (LINK_MANIFEST).
+    cfg.index_root = normal_dir(kv["index_root"].back());
   } else {
     throw std::runtime_error("Config error: INDEX_ROOT=... is required");
   }
@@ -151,17 +352,35 @@ static Config load_config(const fs::path &cfg_path) {
   if (kv.count("clean_on_start") && !kv["clean_on_start"].empty())
     cfg.clean_on_start = parse_bool(kv["clean_on_start"].back(), false);
 
+  if (kv.count("atomic_rebuild") && !kv["atomic_rebuild"].empty())
+    cfg.atomic_rebuild = parse_bool(kv["atomic_rebuild"].back(), false);
+
+  if (kv.count("catalog") && !kv["catalog"].empty())
+    cfg.catalog = parse_bool(kv["catalog"].back(), false);
+
+  if (kv.count("reconcile") && !kv["reconcile"].empty())
+    cfg.reconcile = parse_bool(kv["reconcile"].back(), false);
+
   if (kv.count("follow_symlinks") && !kv["follow_symlinks"].empty())
     cfg.follow_symlinks = parse_bool(kv["follow_symlinks"].back(), false);
 
+  if (kv.count("fast_tags") && !kv["fast_tags"].empty())
+    cfg.fast_tags = parse_bool(kv["fast_tags"].back(), true);
+
+  if (kv.count("tag_cache") && !kv["tag_cache"].empty())
+    cfg.tag_cache = parse_bool(kv["tag_cache"].back(), false);
+
+  if (kv.count("incremental") && !kv["incremental"].empty())
+    cfg.incremental = parse_bool(kv["incremental"].back(), false);
+
   if (kv.count("enable_types") && !kv["enable_types"].empty())
     cfg.enable_types = split_csv(kv["enable_types"].back());
 
   if (kv.count("mp3_indexes") && !kv["mp3_indexes"].empty())
-    cfg.mp3_indexes = split_csv(kv["mp3_indexes"].back());
+    cfg.mp3_indexes = parse_categories(kv["mp3_indexes"].back(), "MP3_INDEXES");
 
   if (kv.count("flac_indexes") && !kv["flac_indexes"].empty())
-    cfg.flac_indexes = split_csv(kv["flac_indexes"].back());
+    cfg.flac_indexes = parse_categories(kv["flac_indexes"].back(), "FLAC_INDEXES");
 
   auto parse_int = [](const std::string &s, int def) {
     try {
@@ -174,15 +393,529 @@ static Config load_config(const fs::path &cfg_path) {
     }
   };
 
+  // Byte counts, optionally with a K/M/G suffix (powers of 1024); 0 if invalid.
+  auto parse_size = [](const std::string &s) -> std::uint64_t {
+    try {
+      std::string t = to_lower(trim(s));
+      std::size_t pos = 0;
+      const double v = std::stod(t, &pos);
+      const std::string unit = trim(t.substr(pos));
+      const double mult = unit.empty() ? 1.0
+                          : unit == "k" ? 1024.0
+                          : unit == "m" ? 1048576.0
+                          : unit == "g" ? 1073741824.0
+                                        : 0.0;
+      return v > 0 ? static_cast<std::uint64_t>(v * mult) : 0;
+    } catch (...) {
+      return 0;
+    }
+  };
+
+  if (kv.count("tag_read_iops") && !kv["tag_read_iops"].empty())
+    cfg.tag_read_iops = parse_int(kv["tag_read_iops"].back(), 0);
+
+  if (kv.count("tag_read_bytes") && !kv["tag_read_bytes"].empty())
+    cfg.tag_read_bytes = parse_size(kv["tag_read_bytes"].back());
+
+  if (kv.count("tag_read_latency_ms") && !kv["tag_read_latency_ms"].empty())
+    cfg.tag_read_latency_ms = parse_int(kv["tag_read_latency_ms"].back(), 0);
+
+  if (kv.count("ioprio_idle") && !kv["ioprio_idle"].empty())
+    cfg.ioprio_idle = parse_bool(kv["ioprio_idle"].back(), false);
+
   if (kv.count("mp3_release_depth") && !kv["mp3_release_depth"].empty())
     cfg.mp3_release_depth = parse_int(kv["mp3_release_depth"].back(), cfg.mp3_release_depth);
 
   if (kv.count("flac_release_depth") && !kv["flac_release_depth"].empty())
     cfg.flac_release_depth = parse_int(kv["flac_release_depth"].back(), cfg.flac_release_depth);
 
+  if (kv.count("metrics_json") && !kv["metrics_json"].empty())
+    cfg.metrics_json = fs::path(kv["metrics_json"].back());
+
+  if (kv.count("metrics_prom") && !kv["metrics_prom"].empty())
+    cfg.metrics_prom = fs::path(kv["metrics_prom"].back());
+
+  if (kv.count("status_json") && !kv["status_json"].empty())
+    cfg.status_json = fs::path(kv["status_json"].back());
+
+  if (kv.count("status_secs") && !kv["status_secs"].empty())
+    cfg.status_secs = parse_int(kv["status_secs"].back(), cfg.status_secs);
+
+  if (kv.count("scan_window_days") && !kv["scan_window_days"].empty())
+    cfg.scan_window_days = parse_int(kv["scan_window_days"].back(), 0);
+
+  if (kv.count("checkpoint_secs") && !kv["checkpoint_secs"].empty())
+    cfg.checkpoint_secs = parse_int(kv["checkpoint_secs"].back(), 0);
+
+  if (kv.count("watch_debounce_ms") && !kv["watch_debounce_ms"].empty())
+    cfg.watch_debounce_ms = parse_int(kv["watch_debounce_ms"].back(), cfg.watch_debounce_ms);
+
+  if (kv.count("threads") && !kv["threads"].empty())
+    cfg.threads = static_cast<unsigned>(parse_int(kv["threads"].back(), static_cast<int>(cfg.threads)));
+
+  if (kv.count("tag_samples") && !kv["tag_samples"].empty())
+    cfg.tag_samples = static_cast<unsigned>(parse_int(kv["tag_samples"].back(), 1));
+
+  if (kv.count("fanout_threshold") && !kv["fanout_threshold"].empty())
+    cfg.fanout_threshold = static_cast<std::size_t>(parse_int(kv["fanout_threshold"].back(), 0));
+
+  if (kv.count("fanout") && !kv["fanout"].empty()) {
+    const std::string mode = to_lower(trim(kv["fanout"].back()));
+    if (mode == "hash") cfg.fanout_hash = true;
+    else if (mode == "alpha") cfg.fanout_hash = false;
+    else throw std::runtime_error("Config error: FANOUT must be alpha or hash: " + kv["fanout"].back());
+  }
+
+  if (kv.count("prefetch_distance") && !kv["prefetch_distance"].empty())
+    cfg.prefetch_distance = static_cast<std::size_t>(parse_int(kv["prefetch_distance"].back(), 0));
+
+  if (kv.count("prefetch_kb") && !kv["prefetch_kb"].empty())
+    cfg.prefetch_kb = static_cast<std::size_t>(parse_int(kv["prefetch_kb"].back(), 64));
+
+  if (kv.count("walk_threads") && !kv["walk_threads"].empty())
+    cfg.walk_threads = static_cast<unsigned>(parse_int(kv["walk_threads"].back(), 1));
+
+  if (kv.count("link_writers") && !kv["link_writers"].empty())
+    cfg.link_writers = static_cast<unsigned>(parse_int(kv["link_writers"].back(), 1));
+
+  if (kv.count("link_manifest") && !kv["link_manifest"].empty())
+    cfg.link_manifest = fs::path(kv["link_manifest"].back());
+
+  if (kv.count("link_apply") && !kv["link_apply"].empty())
+    cfg.link_apply = kv["link_apply"].back();
+
+  if (kv.count("shard") && !kv["shard"].empty()) {
+    cfg.shard = kv["shard"].back();
+    for (char ch : cfg.shard) {
+      if (!std::isalnum(static_cast<unsigned char>(ch)) && ch != '-' && ch != '_') {
+        throw std::runtime_error("Config error: SHARD may only contain letters, digits, '-' and '_': " + cfg.shard);
+      }
+    }
+  }
+
+  // SHARD_PATH_MAP can repeat: /local/prefix=/prefix/on/the/index/host
+  if (kv.count("shard_path_map")) {
+    for (const auto &v : kv["shard_path_map"]) {
+      auto eq = v.find('=');
+      if (eq == std::string::npos || eq == 0 || eq + 1 == v.size()) {
+        throw std::runtime_error("Config error: SHARD_PATH_MAP must be LOCAL=INDEX: " + v);
+      }
+      // Without trailing '/', so "/" is the empty prefix.
+      auto strip = [](std::string p) {
+        while (!p.empty() && p.back() == '/') p.pop_back();
+        return p;
+      };
+      cfg.shard_path_map.emplace_back(strip(trim(v.substr(0, eq))), strip(trim(v.substr(eq + 1))));
+    }
+  }
+
+  cfg.audio_props = ((cfg.mp3_indexes | cfg.flac_indexes) & kAudioCategories) != 0;
+
+  if (!cfg.link_manifest.empty() && cfg.fanout_threshold > 0) {
+    throw std::runtime_error("Config error: LINK_MANIFEST cannot be combined with FANOUT_THRESHOLD");
+  }
+  if (!cfg.shard.empty() && !cfg.link_manifest.empty()) {
+    throw std::runtime_error("Config error: SHARD writes no links, LINK_MANIFEST cannot be used with it");
+  }
+
   return cfg;
 }
 
+// ---- string arena ----
+//
+// Release keys (absolute release paths) are stored once per process in a chunked
+// arena and passed around as string_views. Chunks never move, so a view stays
+// valid for the life of the process.
+
+class StringArena {
+ public:
+  std::string_view store(std::string_view s) {
+    if (chunks_.empty() || used_ + s.size() > chunk_size_) {
+      chunk_size_ = std::max(kChunk, s.size());
+      chunks_.push_back(std::make_unique<char[]>(chunk_size_));
+      used_ = 0;
+    }
+    char *dst = chunks_.back().get() + used_;
+    std::memcpy(dst, s.data(), s.size());
+    used_ += s.size();
+    return {dst, s.size()};
+  }
+
+ private:
+  static constexpr std::size_t kChunk = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  std::size_t chunk_size_ = 0;
+  std::size_t used_ = 0;
+};
+
+class KeyInterner {
+ public:
+  std::string_view intern(std::string_view s) {
+    auto it = keys_.find(s);
+    if (it != keys_.end()) return *it;
+    return *keys_.insert(arena_.store(s)).first;
+  }
+
+ private:
+  StringArena arena_;
+  std::unordered_set<std::string_view> keys_;
+};
+
+// Only touched from the walking (main) thread; workers just read the views.
+static KeyInterner g_release_keys;
+
+// Lets string-keyed maps be searched with a string_view without a temporary.
+struct StringHash {
+  using is_transparent = void;
+  std::size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
+
+// ---- metrics ----
+//
+// Process-wide counters and per-stage latency histograms, updated lock-free from
+// the walker, the tag-reading workers and the link writer, and written out at the
+// end of a run (METRICS_JSON= / METRICS_PROM=).
+
+enum class Stage { Walk, TagRead, Symlink, Clean, Reconcile, Count };
+
+static const char *const kStageNames[] = {"walk", "tag_read", "symlink", "clean", "reconcile"};
+
+// Upper bounds (seconds) of the latency buckets; a final +Inf bucket follows.
+static constexpr double kLatencyBuckets[] = {1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3, 1e-2, 5e-2, 0.1, 0.5, 1.0, 5.0};
+static constexpr std::size_t kNumBuckets = sizeof(kLatencyBuckets) / sizeof(kLatencyBuckets[0]) + 1;
+
+struct StageMetrics {
+  std::atomic<std::uint64_t> calls{0};
+  std::atomic<std::uint64_t> total_ns{0};
+  std::array<std::atomic<std::uint64_t>, kNumBuckets> buckets{};
+
+  void record(std::chrono::nanoseconds d) {
+    calls.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(static_cast<std::uint64_t>(d.count()), std::memory_order_relaxed);
+    const double s = std::chrono::duration<double>(d).count();
+    std::size_t b = 0;
+    while (b + 1 < kNumBuckets && s > kLatencyBuckets[b]) ++b;
+    buckets[b].fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+struct Metrics {
+  std::array<StageMetrics, static_cast<std::size_t>(Stage::Count)> stages;
+  // read_release_info returned nothing (no tag / unreadable file).
+  std::atomic<std::uint64_t> tag_parse_failures{0};
+  std::atomic<std::uint64_t> tag_fast_path{0};
+  std::atomic<std::uint64_t> tag_taglib{0};
+  std::atomic<std::uint64_t> tag_cache_hits{0};
+  std::atomic<std::uint64_t> symlinks_created{0};
+  std::atomic<std::uint64_t> symlinks_kept{0};
+  std::atomic<std::uint64_t> symlink_errors{0};
+  // Approximate bytes read for tags, and time readers waited on the I/O governor.
+  std::atomic<std::uint64_t> tag_read_bytes{0};
+  std::atomic<std::uint64_t> io_throttle_ns{0};
+
+  StageMetrics &stage(Stage s) { return stages[static_cast<std::size_t>(s)]; }
+};
+
+static Metrics g_metrics;
+
+// Records the lifetime of the scope into a stage.
+class StageTimer {
+ public:
+  explicit StageTimer(Stage s) : stage_(s), start_(std::chrono::steady_clock::now()) {}
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+  ~StageTimer() { g_metrics.stage(stage_).record(std::chrono::steady_clock::now() - start_); }
+
+ private:
+  Stage stage_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// ---- status counters ----
+//
+// Progress for STATUS_JSON (see StatusReporter). Every thread counts into its own
+// cache-line-aligned slot with plain relaxed stores (one writer per slot, no
+// locked instructions); the reporter sums the slots. The queue depths it reports
+// are differences between the counters of neighbouring pipeline stages.
+
+enum class Counter : std::uint8_t {
+  Found,        // releases emitted by the walk
+  Checked,      // past the incremental stat batch
+  Queued,       // handed to the tag readers
+  QueuedReady,  // handed to the pool without a read (all from state)
+  Read,         // tag reads finished
+  Delivered,    // results applied in walk order
+  Indexed,      // per type, as in releases_indexed
+  LinksQueued,
+  LinksDone,
+  kCount
+};
+
+static constexpr std::size_t kNumCounters = static_cast<std::size_t>(Counter::kCount);
+
+class Status {
+ public:
+  static constexpr std::size_t kSlowest = 10;
+
+  using Totals = std::array<std::uint64_t, kNumCounters>;
+  using SlowPath = std::pair<std::uint64_t, std::string>;  // read time (ns), release dir
+
+  // Before any counting thread starts.
+  void enable() { enabled_ = true; }
+  bool enabled() const { return enabled_; }
+
+  void add(Counter c, std::uint64_t n = 1) {
+    if (!enabled_) return;
+    std::atomic<std::uint64_t> &a = slot().n[static_cast<std::size_t>(c)];
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  // Keep the thread's kSlowest slowest release reads. The slot's mutex is only
+  // taken while the list fills up and when a read beats its fastest entry.
+  void read_time(std::chrono::nanoseconds d, const fs::path &release_dir) {
+    if (!enabled_) return;
+    Slot &s = slot();
+    const auto ns = static_cast<std::uint64_t>(d.count());
+    if (ns <= s.slow_floor) return;
+    std::lock_guard<std::mutex> lk(s.slow_m);
+    s.slow.emplace_back(ns, release_dir.string());
+    if (s.slow.size() > kSlowest) {
+      s.slow.erase(std::min_element(s.slow.begin(), s.slow.end()));
+    }
+    if (s.slow.size() == kSlowest) s.slow_floor = std::min_element(s.slow.begin(), s.slow.end())->first;
+  }
+
+  Totals totals() const {
+    Totals t{};
+    std::lock_guard<std::mutex> lk(m_);
+    for (const auto &s : slots_) {
+      for (std::size_t i = 0; i < kNumCounters; ++i) t[i] += s->n[i].load(std::memory_order_relaxed);
+    }
+    return t;
+  }
+
+  std::vector<SlowPath> slowest() const {
+    std::vector<SlowPath> out;
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      for (const auto &s : slots_) {
+        std::lock_guard<std::mutex> sl(s->slow_m);
+        out.insert(out.end(), s->slow.begin(), s->slow.end());
+      }
+    }
+    std::sort(out.begin(), out.end(), std::greater<>());
+    if (out.size() > kSlowest) out.resize(kSlowest);
+    return out;
+  }
+
+  // Rarely changing run state: phase ("scanning", ...), current root, and the
+  // release count expected for the ETA (previous run's, 0 = unknown).
+  void begin_run(std::uint64_t expected) {
+    const std::uint64_t base = totals()[static_cast<std::size_t>(Counter::Indexed)];
+    std::lock_guard<std::mutex> lk(m_);
+    phase_ = "scanning";
+    expected_ = expected;
+    indexed_base_ = base;
+    run_start_ = std::chrono::steady_clock::now();
+  }
+  void set_phase(std::string phase) {
+    std::lock_guard<std::mutex> lk(m_);
+    phase_ = std::move(phase);
+  }
+  void set_root(const fs::path &root) {
+    if (!enabled_) return;
+    std::lock_guard<std::mutex> lk(m_);
+    root_ = root.string();
+  }
+
+  struct Run {
+    std::string phase;
+    std::string root;
+    std::uint64_t expected = 0;
+    std::uint64_t indexed_base = 0;
+    std::chrono::steady_clock::time_point start;
+  };
+  Run run() const {
+    std::lock_guard<std::mutex> lk(m_);
+    return Run{phase_, root_, expected_, indexed_base_, run_start_};
+  }
+
+ private:
+  struct alignas(64) Slot {
+    std::array<std::atomic<std::uint64_t>, kNumCounters> n{};
+    std::mutex slow_m;
+    std::vector<SlowPath> slow;
+    // Owner thread only: reads at or below this can't enter the full list.
+    std::uint64_t slow_floor = 0;
+  };
+
+  // A thread's slot goes back to the free list when the thread exits and is
+  // reused (counts included) by the next one, so pools created per scan root
+  // don't grow the list.
+  Slot &slot() {
+    struct Lease {
+      Status *owner = nullptr;
+      Slot *slot = nullptr;
+      ~Lease() {
+        if (!slot) return;
+        std::lock_guard<std::mutex> lk(owner->m_);
+        owner->free_.push_back(slot);
+      }
+    };
+    thread_local Lease lease;
+    if (!lease.slot) {
+      std::lock_guard<std::mutex> lk(m_);
+      lease.owner = this;
+      if (!free_.empty()) {
+        lease.slot = free_.back();
+        free_.pop_back();
+      } else {
+        slots_.push_back(std::make_unique<Slot>());
+        lease.slot = slots_.back().get();
+      }
+    }
+    return *lease.slot;
+  }
+
+  bool enabled_ = false;
+  mutable std::mutex m_;
+  std::vector<std::unique_ptr<Slot>> slots_;
+  std::vector<Slot *> free_;
+  std::string phase_ = "starting";
+  std::string root_;
+  std::uint64_t expected_ = 0;
+  std::uint64_t indexed_base_ = 0;
+  std::chrono::steady_clock::time_point run_start_ = std::chrono::steady_clock::now();
+};
+
+static Status g_status;
+
+// ---- I/O governor ----
+//
+// Keeps tag reading from starving other users of the disks (FTP downloads).
+// TAG_READ_IOPS caps the audio files opened per second, TAG_READ_BYTES the bytes
+// read per second (both across all reader threads). With TAG_READ_LATENCY_MS the
+// number of files read at once adapts to the per-file read time: the limit is
+// halved when the moving average goes above the target and grows by one again
+// after a run of reads below half of it. IOPRIO_IDLE=true moves every reader
+// thread into the idle I/O scheduling class (honoured by BFQ and CFQ), so the
+// kernel only serves it when nobody else needs the disk.
+
+// Bytes this thread read through ByteWindow, for the byte rate.
+static thread_local std::uint64_t t_read_bytes = 0;
+
+class IoGovernor {
+ public:
+  void configure(unsigned readers, double iops, double bytes_per_sec, double latency_ms, bool idle) {
+    std::lock_guard<std::mutex> lk(m_);
+    max_readers_ = std::max(readers, 1u);
+    limit_ = max_readers_;
+    iop_ns_ = iops > 0 ? 1e9 / iops : 0;
+    byte_ns_ = bytes_per_sec > 0 ? 1e9 / bytes_per_sec : 0;
+    target_ns_ = latency_ms * 1e6;
+    idle_ = idle;
+    enabled_ = iop_ns_ > 0 || byte_ns_ > 0 || target_ns_ > 0 || idle;
+  }
+
+  bool enabled() const { return enabled_; }
+  bool rate_limited() const { return iop_ns_ > 0 || byte_ns_ > 0; }
+
+  // Put the calling thread in the configured I/O class, for I/O outside acquire().
+  void apply_io_class() {
+    if (idle_) set_idle_class();
+  }
+
+  // Readers currently allowed at once.
+  unsigned limit() {
+    std::lock_guard<std::mutex> lk(m_);
+    return limit_;
+  }
+
+  // Wait until this thread may read one more file.
+  void acquire() {
+    if (idle_) set_idle_class();
+    std::chrono::steady_clock::time_point start;
+    const auto now = std::chrono::steady_clock::now();
+    {
+      std::unique_lock<std::mutex> lk(m_);
+      cv_.wait(lk, [&] { return active_ < limit_; });
+      ++active_;
+      start = std::max(now, not_before_);
+      not_before_ = start + std::chrono::nanoseconds(static_cast<std::int64_t>(iop_ns_));
+    }
+    if (start > now) std::this_thread::sleep_until(start);
+    const auto waited = std::chrono::steady_clock::now() - now;
+    g_metrics.io_throttle_ns.fetch_add(static_cast<std::uint64_t>(waited.count()), std::memory_order_relaxed);
+  }
+
+  // The file took `elapsed` to read and about `bytes` were read.
+  void release(std::chrono::nanoseconds elapsed, std::uint64_t bytes) {
+    const auto now = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      --active_;
+      if (byte_ns_ > 0) {
+        not_before_ = std::max(not_before_, now) +
+                      std::chrono::nanoseconds(static_cast<std::int64_t>(byte_ns_ * static_cast<double>(bytes)));
+      }
+      if (target_ns_ > 0) adapt(static_cast<double>(elapsed.count()), now);
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  // AIMD on the reader limit; cuts are at least one target apart so the reads
+  // started before a cut don't halve the limit again.
+  void adapt(double ns, std::chrono::steady_clock::time_point now) {
+    ewma_ns_ = ewma_ns_ == 0 ? ns : 0.8 * ewma_ns_ + 0.2 * ns;
+    if (ewma_ns_ > target_ns_) {
+      good_ = 0;
+      if (limit_ > 1 && now - last_cut_ > std::chrono::nanoseconds(static_cast<std::int64_t>(target_ns_))) {
+        limit_ = std::max(1u, limit_ / 2);
+        last_cut_ = now;
+        std::cerr << "[io] tag reads averaging " << ewma_ns_ / 1e6 << " ms, readers: " << limit_ << "\n";
+      }
+    } else if (ewma_ns_ < target_ns_ / 2 && limit_ < max_readers_ && ++good_ >= 8 * limit_) {
+      ++limit_;
+      good_ = 0;
+    }
+  }
+
+  static void set_idle_class() {
+    static thread_local bool done = false;
+    if (done) return;
+    done = true;
+#ifdef __linux__
+    // linux/ioprio.h: IOPRIO_WHO_PROCESS with who = 0 is the calling thread.
+    constexpr int kWhoProcess = 1;
+    constexpr int kClassIdle = 3;
+    constexpr int kClassShift = 13;
+    if (::syscall(SYS_ioprio_set, kWhoProcess, 0, kClassIdle << kClassShift) != 0) {
+      std::cerr << "[warn] ioprio_set(IDLE) failed: " << std::strerror(errno) << "\n";
+    }
+#else
+    std::cerr << "[warn] IOPRIO_IDLE needs Linux (ioprio_set), ignored\n";
+#endif
+  }
+
+  std::mutex m_;
+  std::condition_variable cv_;
+  bool enabled_ = false;
+  bool idle_ = false;
+  unsigned max_readers_ = 1;
+  unsigned limit_ = 1;
+  unsigned active_ = 0;
+  unsigned good_ = 0;
+  double iop_ns_ = 0;
+  double byte_ns_ = 0;
+  double target_ns_ = 0;
+  double ewma_ns_ = 0;
+  std::chrono::steady_clock::time_point not_before_{};
+  std::chrono::steady_clock::time_point last_cut_{};
+};
+
+static IoGovernor g_io;
+
 struct ReleaseInfo {
   fs::path release_dir;
   std::string release_name;
@@ -192,6 +925,11 @@ struct ReleaseInfo {
   std::string year;
   std::string group;
   char alpha;
+  // Values of the bitrate/format/length indexes; empty when the audio properties
+  // weren't read.
+  std::string bitrate;
+  std::string format;
+  std::string length;
 };
 
 static std::string taglib_string_to_utf8(const TagLib::String &s) {
@@ -201,237 +939,5232 @@ static std::string taglib_string_to_utf8(const TagLib::String &s) {
 }
 
 
-static std::optional<ReleaseInfo> read_release_info(const fs::path &audio_file,
-                                                    const fs::path &release_dir) {
-  TagLib::FileRef f(audio_file.c_str());
+// ---- tag reading ----
+
+// The four tag fields the indexer uses, as TagLib's Tag interface reports them.
+struct TagFields {
+  std::string artist;
+  std::string album;
+  std::string genre;
+  unsigned int year = 0;
+  // Audio properties, only read for the bitrate/format/length indexes. `format` is
+  // CBR/VBR for MP3 and the bit depth ("16bit") for FLAC.
+  bool has_audio = false;
+  unsigned bitrate = 0;  // kbps
+  unsigned length = 0;   // seconds
+  std::string format;
+};
+
+// Tags-only TagLib open unless `audio`: audio properties (bitrate/length, the
+// MP3 Xing/VBRI scan) are only read when the built-in parser couldn't get them.
+static std::optional<TagFields> read_tags_taglib(const fs::path &audio_file, bool audio) {
+  TagLib::FileRef f(audio_file.c_str(), audio);
   if (f.isNull() || !f.tag()) return std::nullopt;
 
   TagLib::Tag *t = f.tag();
+  TagFields tf;
+  tf.artist = taglib_string_to_utf8(t->artist());
+  tf.album = taglib_string_to_utf8(t->album());
+  tf.genre = taglib_string_to_utf8(t->genre());
+  tf.year = t->year();
+  if (audio && f.audioProperties()) {
+    tf.has_audio = true;
+    tf.bitrate = static_cast<unsigned>(std::max(f.audioProperties()->bitrate(), 0));
+    tf.length = static_cast<unsigned>(std::max(f.audioProperties()->lengthInSeconds(), 0));
+  }
+  return tf;
+}
 
-  ReleaseInfo info;
-  info.release_dir = release_dir;
-  info.release_name = info.release_dir.filename().string();
+// Positional reader with a single read-ahead window: walking ID3v2 frame headers
+// or FLAC metadata blocks costs one read per window rather than one per field.
+class ByteWindow {
+ public:
+  static constexpr std::size_t kWindow = 64 * 1024;
 
-  info.artist = sanitize_component(taglib_string_to_utf8(t->artist()));
-  info.album  = sanitize_component(taglib_string_to_utf8(t->album()));
+  explicit ByteWindow(const fs::path &p) : fd_(::open(p.c_str(), O_RDONLY | O_CLOEXEC)) {}
+  ByteWindow(const ByteWindow &) = delete;
+  ByteWindow &operator=(const ByteWindow &) = delete;
+  ~ByteWindow() {
+    if (fd_ >= 0) ::close(fd_);
+  }
 
-  std::string genre = taglib_string_to_utf8(t->genre());
-  info.genre = sanitize_component(genre);
+  bool ok() const { return fd_ >= 0; }
 
-  unsigned int y = t->year();
-  info.year = (y > 0) ? std::to_string(y) : "Unknown";
+  std::uint64_t size() const {
+    struct stat st {};
+    return (fd_ >= 0 && ::fstat(fd_, &st) == 0) ? static_cast<std::uint64_t>(st.st_size) : 0;
+  }
 
-  // group: substring after last '-' in release_name
-  auto pos = info.release_name.find_last_of('-');
-  if (pos != std::string::npos && pos + 1 < info.release_name.size()) {
-    info.group = sanitize_component(info.release_name.substr(pos + 1));
-  } else {
-    info.group = "Unknown";
+  // Pointer to `len` bytes at `off`, or nullptr if they can't be read.
+  const unsigned char *get(std::uint64_t off, std::size_t len) {
+    if (off >= buf_off_ && off + len <= buf_off_ + buf_.size()) return buf_.data() + (off - buf_off_);
+    buf_.resize(std::max(len, kWindow));
+    ssize_t n = ::pread(fd_, buf_.data(), buf_.size(), static_cast<off_t>(off));
+    buf_.resize(n > 0 ? static_cast<std::size_t>(n) : 0);
+    t_read_bytes += buf_.size();
+    buf_off_ = off;
+    return buf_.size() >= len ? buf_.data() : nullptr;
   }
 
-  // alpha: first character (A-Z, 0-9); otherwise '#'
-  char c = info.release_name.empty() ? '#' : info.release_name[0];
-  c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
-  info.alpha = (std::isalnum(static_cast<unsigned char>(c)) ? c : '#');
+ private:
+  int fd_;
+  std::vector<unsigned char> buf_;
+  std::uint64_t buf_off_ = 0;
+};
 
-  return info;
+static std::uint32_t be32(const unsigned char *p) {
+  return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | p[3];
 }
 
-static void ensure_dir(const fs::path &p, bool dry_run) {
-  if (dry_run) return;
-  std::error_code ec;
-  fs::create_directories(p, ec);
-  if (ec) {
-    throw std::runtime_error("Cannot create directory: " + p.string() + " (" + ec.message() + ")");
+static std::uint32_t le32(const unsigned char *p) {
+  return (std::uint32_t(p[3]) << 24) | (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[1]) << 8) | p[0];
+}
+
+static std::optional<std::uint32_t> syncsafe32(const unsigned char *p) {
+  if ((p[0] | p[1] | p[2] | p[3]) & 0x80) return std::nullopt;
+  return (std::uint32_t(p[0]) << 21) | (std::uint32_t(p[1]) << 14) | (std::uint32_t(p[2]) << 7) | p[3];
+}
+
+static void append_utf8(std::string &out, std::uint32_t cp) {
+  if (cp < 0x80) {
+    out.push_back(static_cast<char>(cp));
+  } else if (cp < 0x800) {
+    out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+  } else {
+    out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
   }
 }
 
-static bool create_or_replace_symlink(const fs::path &target_abs,
-                                     const fs::path &link_path,
-                                     bool relative,
-                                     bool force,
-                                     bool dry_run) {
-  std::error_code ec;
-  fs::path link_parent = link_path.parent_path();
+// Decode an ID3v2 text frame body (encoding byte + text) to UTF-8. Returns false
+// for anything TagLib would post-process differently, i.e. multiple
+// null-separated values or UTF-16 without a BOM; the caller then uses TagLib.
+static bool decode_id3_text(const unsigned char *p, std::size_t len, std::string &out) {
+  out.clear();
+  if (len == 0) return true;
+  const unsigned enc = p[0];
+  ++p;
+  --len;
 
-  fs::path target = target_abs;
-  if (relative) {
-    target = fs::relative(target_abs, link_parent, ec);
-    if (ec) {
-      // fallback to absolute
-      target = target_abs;
-      ec.clear();
+  if (enc == 0 || enc == 3) {
+    std::size_t n = 0;
+    while (n < len && p[n] != 0) ++n;
+    for (std::size_t i = n; i < len; ++i) {
+      if (p[i] != 0) return false;
+    }
+    if (enc == 3) {
+      out.assign(reinterpret_cast<const char *>(p), n);
+    } else {
+      for (std::size_t i = 0; i < n; ++i) append_utf8(out, p[i]);
     }
+    return true;
   }
 
-  if (fs::exists(link_path, ec)) {
-    if (!force) return false;
-    if (!dry_run) {
-      fs::remove(link_path, ec);
-      if (ec) {
-        throw std::runtime_error("Cannot remove existing link: " + link_path.string() + " (" + ec.message() + ")");
+  if (enc != 1 && enc != 2) return false;
+  bool big_endian = (enc == 2);
+  std::size_t i = 0;
+  if (enc == 1) {
+    if (len < 2) return len == 0;
+    if (p[0] == 0xFF && p[1] == 0xFE) big_endian = false;
+    else if (p[0] == 0xFE && p[1] == 0xFF) big_endian = true;
+    else return false;
+    i = 2;
+  }
+  auto unit = [&](std::size_t at) {
+    return big_endian ? std::uint32_t((p[at] << 8) | p[at + 1]) : std::uint32_t((p[at + 1] << 8) | p[at]);
+  };
+  for (; i + 1 < len; i += 2) {
+    std::uint32_t u = unit(i);
+    if (u == 0) {
+      for (std::size_t j = i + 2; j < len; ++j) {
+        if (p[j] != 0) return false;
       }
+      break;
     }
+    if (u >= 0xD800 && u < 0xDC00 && i + 3 < len) {
+      std::uint32_t lo = unit(i + 2);
+      if (lo >= 0xDC00 && lo < 0xE000) {
+        append_utf8(out, 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00));
+        i += 2;
+        continue;
+      }
+    }
+    append_utf8(out, (u >= 0xD800 && u < 0xE000) ? 0xFFFD : u);
   }
+  return true;
+}
 
-  if (dry_run) return true;
+// Leading digits of a date string ("2021", "2021-05-03"), as TagLib's year().
+static unsigned int parse_year_prefix(const std::string &s) {
+  unsigned int y = 0;
+  for (std::size_t i = 0; i < s.size() && i < 4 && std::isdigit(static_cast<unsigned char>(s[i])); ++i)
+    y = y * 10 + static_cast<unsigned int>(s[i] - '0');
+  return y;
+}
 
-  fs::create_symlink(target, link_path, ec);
-  if (ec) {
-    throw std::runtime_error("symlink failed: " + link_path.string() + " -> " + target.string() + " (" + ec.message() + ")");
-  }
-  return true;
+// TagLib maps numeric ID3 genres ("17", "(17)", "(17)Rock") to names; leave
+// those to it.
+static bool genre_needs_taglib(const std::string &g) {
+  if (g.empty()) return false;
+  if (g[0] == '(') return true;
+  return std::all_of(g.begin(), g.end(), [](unsigned char c) { return std::isdigit(c); });
 }
 
-static void clean_index_tree(const fs::path &base, bool dry_run) {
-  if (dry_run) return;
-  std::error_code ec;
-  if (fs::exists(base, ec)) {
-    for (auto it = fs::directory_iterator(base, ec); !ec && it != fs::directory_iterator(); ++it) {
-      fs::remove_all(it->path(), ec);
-      if (ec) break;
+// Fields found so far by a fast reader.
+struct FastTags {
+  TagFields fields;
+  bool artist = false;
+  bool album = false;
+  bool genre = false;
+  bool year = false;
+
+  bool complete() const { return artist && album && genre && year; }
+};
+
+// Size of an ID3v2 tag at offset 0 (header, body and footer), 0 if none.
+static std::optional<std::uint64_t> id3v2_tag_size(ByteWindow &in) {
+  const unsigned char *h = in.get(0, 10);
+  if (!h || h[0] != 'I' || h[1] != 'D' || h[2] != '3') return 0;
+  auto body = syncsafe32(h + 6);
+  if (!body) return std::nullopt;
+  return 10 + std::uint64_t(*body) + ((h[5] & 0x10) ? 10 : 0);
+}
+
+// Parse the text frames we need out of the ID3v2 tag at offset 0. nullopt means
+// "let TagLib do it" (no tag, unsynchronisation, compressed/encrypted frames, ...).
+static std::optional<FastTags> parse_id3v2(ByteWindow &in) {
+  const unsigned char *h = in.get(0, 10);
+  if (!h || h[0] != 'I' || h[1] != 'D' || h[2] != '3') return std::nullopt;
+  const unsigned ver = h[3];
+  const unsigned flags = h[5];
+  if (ver < 2 || ver > 4) return std::nullopt;
+  // Whole-tag unsynchronisation, and v2.2 compression.
+  if ((flags & 0x80) || (ver == 2 && (flags & 0x40))) return std::nullopt;
+  auto tag_size = syncsafe32(h + 6);
+  if (!tag_size) return std::nullopt;
+
+  std::uint64_t pos = 10;
+  const std::uint64_t end = 10 + std::uint64_t(*tag_size);
+  if (ver >= 3 && (flags & 0x40)) {
+    const unsigned char *x = in.get(pos, 4);
+    if (!x) return std::nullopt;
+    if (ver == 3) {
+      pos += 4 + be32(x);
+    } else {
+      auto xs = syncsafe32(x);
+      if (!xs) return std::nullopt;
+      pos += *xs;
     }
   }
-  if (ec) {
-    throw std::runtime_error("Failed to clean index tree: " + base.string() + " (" + ec.message() + ")");
+
+  const std::size_t id_len = (ver == 2) ? 3 : 4;
+  const std::size_t hdr_len = (ver == 2) ? 6 : 10;
+  FastTags ft;
+  while (pos + hdr_len <= end && !ft.complete()) {
+    const unsigned char *fh = in.get(pos, hdr_len);
+    if (!fh) return std::nullopt;
+    if (fh[0] == 0) break;  // padding
+    for (std::size_t i = 0; i < id_len; ++i) {
+      if (!std::isupper(fh[i]) && !std::isdigit(fh[i])) return std::nullopt;
+    }
+    std::string id(reinterpret_cast<const char *>(fh), id_len);
+
+    std::uint32_t size = 0;
+    unsigned frame_flags = 0;
+    if (ver == 2) {
+      size = (std::uint32_t(fh[3]) << 16) | (std::uint32_t(fh[4]) << 8) | fh[5];
+    } else if (ver == 3) {
+      size = be32(fh + 4);
+      frame_flags = (unsigned(fh[8]) << 8) | fh[9];
+    } else {
+      // Non-syncsafe v2.4 sizes (old iTunes) need TagLib's heuristics.
+      auto ss = syncsafe32(fh + 4);
+      if (!ss) return std::nullopt;
+      size = *ss;
+      frame_flags = (unsigned(fh[8]) << 8) | fh[9];
+    }
+    pos += hdr_len;
+    if (pos + size > end) return std::nullopt;
+
+    std::string *dst = nullptr;
+    bool *have = nullptr;
+    bool is_year = false;
+    if (id == "TPE1" || id == "TP1") { dst = &ft.fields.artist; have = &ft.artist; }
+    else if (id == "TALB" || id == "TAL") { dst = &ft.fields.album; have = &ft.album; }
+    else if (id == "TCON" || id == "TCO") { dst = &ft.fields.genre; have = &ft.genre; }
+    else if (id == "TDRC" || id == "TYER" || id == "TYE") { is_year = true; have = &ft.year; }
+
+    if (have && !*have) {
+      // Compression, encryption, grouping, per-frame unsync, data length indicator.
+      const unsigned bad = (ver == 3) ? 0x00E0 : 0x004F;
+      if (frame_flags & bad) return std::nullopt;
+      if (size > (1u << 20)) return std::nullopt;
+      const unsigned char *body = in.get(pos, size);
+      if (!body) return std::nullopt;
+      std::string text;
+      if (!decode_id3_text(body, size, text)) return std::nullopt;
+      if (is_year) {
+        ft.fields.year = parse_year_prefix(text);
+      } else {
+        if (dst == &ft.fields.genre && genre_needs_taglib(text)) return std::nullopt;
+        *dst = std::move(text);
+      }
+      *have = true;
+    }
+    pos += size;
   }
+  return ft;
 }
 
-static void index_release(const std::string &type,
-                          const ReleaseInfo &info,
-                          const Config &cfg,
-                          const std::vector<std::string> &indexes,
-                          bool force,
-                          bool dry_run) {
-  fs::path type_root = cfg.index_root / type;
+// Parse ARTIST/ALBUM/GENRE/DATE from the FLAC VORBIS_COMMENT block, skipping all
+// other metadata blocks without reading them. `data_start` is where "fLaC" is.
+static std::optional<FastTags> parse_flac_vorbis(ByteWindow &in, std::uint64_t data_start) {
+  const unsigned char *m = in.get(data_start, 4);
+  if (!m || m[0] != 'f' || m[1] != 'L' || m[2] != 'a' || m[3] != 'C') return std::nullopt;
 
-  auto add_index = [&](const std::string &idx_name, const fs::path &subdir) {
-    fs::path base = type_root / idx_name / subdir;
-    ensure_dir(base, dry_run);
-    fs::path link = base / info.release_name;
-    fs::path target = fs::absolute(info.release_dir);
+  std::uint64_t pos = data_start + 4;
+  while (true) {
+    const unsigned char *bh = in.get(pos, 4);
+    if (!bh) return std::nullopt;
+    const bool last = (bh[0] & 0x80) != 0;
+    const unsigned type = bh[0] & 0x7F;
+    const std::uint32_t len = (std::uint32_t(bh[1]) << 16) | (std::uint32_t(bh[2]) << 8) | bh[3];
+    pos += 4;
+    if (type == 4) {
+      if (len > (16u << 20)) return std::nullopt;
+      const unsigned char *b = in.get(pos, len);
+      if (!b) return std::nullopt;
+      std::size_t off = 0;
+      auto read32 = [&](std::uint32_t &v) {
+        if (off + 4 > len) return false;
+        v = le32(b + off);
+        off += 4;
+        return true;
+      };
+      std::uint32_t vendor = 0, count = 0;
+      if (!read32(vendor) || off + vendor > len) return std::nullopt;
+      off += vendor;
+      if (!read32(count)) return std::nullopt;
 
-    (void)create_or_replace_symlink(target, link, cfg.relative_symlinks, force, dry_run);
-  };
+      FastTags ft;
+      std::string date, year;
+      bool have_date = false, have_year = false;
+      for (std::uint32_t i = 0; i < count; ++i) {
+        std::uint32_t flen = 0;
+        if (!read32(flen) || off + flen > len) return std::nullopt;
+        std::string field(reinterpret_cast<const char *>(b + off), flen);
+        off += flen;
+        auto eq = field.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = field.substr(0, eq);
+        for (auto &ch : key) ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+        std::string val = field.substr(eq + 1);
 
-  for (const auto &idx : indexes) {
-    if (idx == "alpha") {
-      std::string a(1, info.alpha);
-      add_index("alpha", fs::path(a));
-    } else if (idx == "genre") {
-      add_index("genre", fs::path(info.genre));
-    } else if (idx == "year") {
-      add_index("year", fs::path(info.year));
-    } else if (idx == "artist") {
-      add_index("artist", fs::path(info.artist));
-    } else if (idx == "album") {
-      add_index("album", fs::path(info.album));
-    } else if (idx == "groups" || idx == "group") {
-      add_index("groups", fs::path(info.group));
+        std::string *dst = nullptr;
+        bool *have = nullptr;
+        if (key == "ARTIST") { dst = &ft.fields.artist; have = &ft.artist; }
+        else if (key == "ALBUM") { dst = &ft.fields.album; have = &ft.album; }
+        else if (key == "GENRE") { dst = &ft.fields.genre; have = &ft.genre; }
+        else if (key == "DATE") { dst = &date; have = &have_date; }
+        else if (key == "YEAR") { dst = &year; have = &have_year; }
+        if (!have) continue;
+        // TagLib joins repeated fields; leave that to it.
+        if (*have) return std::nullopt;
+        *dst = std::move(val);
+        *have = true;
+      }
+      ft.fields.year = parse_year_prefix(have_date ? date : year);
+      ft.year = have_date || have_year;
+      return ft;
     }
+    if (last) return FastTags{};
+    pos += len;
   }
 }
 
-static bool has_ext(const fs::path &p, const std::string &ext_lower) {
-  std::string e = to_lower(p.extension().string());
-  return e == ext_lower;
+// Whether TagLib would also look at an ID3v1 or APE tag at the end of the file to
+// fill fields the primary tag lacks.
+static bool has_trailing_tags(ByteWindow &in) {
+  std::uint64_t size = in.size();
+  if (size < 32) return false;
+  std::uint64_t start = size >= 160 ? size - 160 : 0;
+  const unsigned char *t = in.get(start, static_cast<std::size_t>(size - start));
+  if (!t) return true;
+  const std::size_t n = static_cast<std::size_t>(size - start);
+  if (n >= 128 && t[n - 128] == 'T' && t[n - 127] == 'A' && t[n - 126] == 'G') return true;
+  for (std::size_t at : {n - 32, n >= 160 ? n - 160 : n}) {
+    if (at + 8 <= n && std::equal(t + at, t + at + 8, "APETAGEX")) return true;
+  }
+  return false;
 }
 
-static fs::path compute_release_dir(const fs::path &root,
-                                   const fs::path &file_path,
-                                   int release_depth) {
-  // Determine release dir relative to root: take the first `release_depth` components
-  // of the file's parent path (relative to root). This supports layouts like:
-  //   root/YYYY-MM-DD/<release>/.../track.mp3  => depth=2
-  //   root/<release>/track.flac               => depth=1
-  fs::path rel = file_path.lexically_relative(root);
-  fs::path rel_parent = rel.parent_path();
-  if (rel_parent.empty()) return file_path.parent_path();
+// Format-specific fast path: one or two small reads for the common cases.
+// nullopt means the caller should fall back to TagLib.
+static std::optional<TagFields> read_tags_fast(ByteWindow &in, bool flac) {
+  if (!in.ok()) return std::nullopt;
 
-  fs::path acc;
-  int count = 0;
-  for (auto it = rel_parent.begin(); it != rel_parent.end(); ++it) {
-    acc /= *it;
-    ++count;
-    if (count >= release_depth) break;
+  std::optional<FastTags> ft;
+  bool other_tags = false;
+  if (!flac) {
+    ft = parse_id3v2(in);
+  } else {
+    auto id3 = id3v2_tag_size(in);
+    if (!id3) return std::nullopt;
+    other_tags = *id3 > 0;
+    ft = parse_flac_vorbis(in, *id3);
   }
-
-  // If there were fewer components than release_depth, just use the full parent.
-  if (count < release_depth) acc = rel_parent;
-  return root / acc;
+  if (!ft) return std::nullopt;
+  // Missing fields are only final if there's nothing TagLib could fill them from.
+  if (!ft->complete() && (other_tags || has_trailing_tags(in))) return std::nullopt;
+  return ft->fields;
 }
 
-static void run_for_type(const std::string &type,
-                         const Config &cfg,
-                         const std::vector<std::string> &indexes,
-                         bool force,
-                         bool clean,
-                         bool dry_run) {
-  const std::string ext = (type == "mp3") ? ".mp3" : ".flac";
-  const int release_depth = (type == "mp3") ? cfg.mp3_release_depth : cfg.flac_release_depth;
+// ---- audio properties ----
+//
+// For the bitrate/format/length indexes. Read through the same ByteWindow as the
+// tags: the FLAC STREAMINFO block, or the first MPEG audio frame after the ID3v2
+// tag with its Xing/Info/VBRI header. Files this can't handle go to TagLib's
+// audio properties (format "Unknown").
+
+struct MpegFrame {
+  bool mpeg1;
+  unsigned kbps;
+  unsigned sample_rate;
+  bool mono;
+  std::uint32_t size;
+};
 
-  const std::vector<fs::path> &roots =
-      (type == "mp3") ? (cfg.mp3_dirs.empty() ? cfg.music_dirs : cfg.mp3_dirs)
-                     : (cfg.flac_dirs.empty() ? cfg.music_dirs : cfg.flac_dirs);
+static std::optional<MpegFrame> mpeg_frame_header(const unsigned char *h) {
+  static constexpr unsigned kKbps1[] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320};
+  static constexpr unsigned kKbps2[] = {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160};
+  static constexpr unsigned kRates[] = {44100, 48000, 32000};
+  if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) return std::nullopt;
+  const unsigned version = (h[1] >> 3) & 3;  // 0: 2.5, 2: 2, 3: 1
+  const unsigned layer = (h[1] >> 1) & 3;    // 1: Layer III
+  const unsigned br = h[2] >> 4;
+  const unsigned sr = (h[2] >> 2) & 3;
+  if (version == 1 || layer != 1 || br == 0 || br == 15 || sr == 3) return std::nullopt;
+  MpegFrame f;
+  f.mpeg1 = version == 3;
+  f.kbps = f.mpeg1 ? kKbps1[br] : kKbps2[br];
+  f.sample_rate = kRates[sr] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  f.mono = (h[3] >> 6) == 3;
+  f.size = (f.mpeg1 ? 144000 : 72000) * f.kbps / f.sample_rate + ((h[2] >> 1) & 1);
+  return f;
+}
 
-  fs::path type_root = cfg.index_root / type;
-  if (clean) {
-    // Clean only the categories we will touch.
-    for (const auto &idx : indexes) {
-      std::string cat = idx;
-      if (cat == "group") cat = "groups";
-      fs::path base = type_root / cat;
-      clean_index_tree(base, dry_run);
+static bool parse_mpeg_audio(ByteWindow &in, std::uint64_t start, TagFields &out) {
+  constexpr std::size_t kScan = 4096;
+  const std::uint64_t size = in.size();
+  if (start >= size) return false;
+  // get() reuses its buffer, so keep the scanned span in a copy.
+  const std::size_t span = static_cast<std::size_t>(std::min<std::uint64_t>(kScan + 4, size - start));
+  const unsigned char *p = in.get(start, span);
+  if (!p) return false;
+  const std::vector<unsigned char> scan(p, p + span);
+  for (std::size_t at = 0; at + 4 <= span; ++at) {
+    auto f = mpeg_frame_header(scan.data() + at);
+    if (!f) continue;
+    const std::uint64_t pos = start + at;
+    // A second header right after the first rules out a stray sync in junk data.
+    if (pos + f->size + 4 <= size) {
+      const unsigned char *n = in.get(pos + f->size, 4);
+      if (!n || !mpeg_frame_header(n)) continue;
+    }
+    // Xing/Info follows the side info, VBRI sits at a fixed 32 bytes.
+    const std::size_t side = f->mpeg1 ? (f->mono ? 17 : 32) : (f->mono ? 9 : 17);
+    const std::size_t head = static_cast<std::size_t>(std::min<std::uint64_t>(4 + 32 + 18, size - pos));
+    const unsigned char *h = in.get(pos, head);
+    const unsigned char *x = h && 4 + side + 16 <= head ? h + 4 + side : nullptr;
+    const unsigned char *v = h && 4 + 32 + 18 <= head ? h + 4 + 32 : nullptr;
+    const unsigned spf = f->mpeg1 ? 1152 : 576;
+    std::uint32_t frames = 0, bytes = 0;
+    bool vbr = false;
+    if (x && (std::equal(x, x + 4, "Xing") || std::equal(x, x + 4, "Info"))) {
+      vbr = x[0] == 'X';
+      const std::uint32_t flags = be32(x + 4);
+      std::size_t off = 8;
+      if (flags & 1) {
+        frames = be32(x + off);
+        off += 4;
+      }
+      if (flags & 2) bytes = be32(x + off);
+    } else if (v && std::equal(v, v + 4, "VBRI")) {
+      vbr = true;
+      bytes = be32(v + 10);
+      frames = be32(v + 14);
+    }
+    out.has_audio = true;
+    out.format = vbr ? "VBR" : "CBR";
+    if (frames > 0) {
+      const double secs = double(frames) * spf / f->sample_rate;
+      const double audio_bytes = bytes ? double(bytes) : double(size - pos);
+      out.length = static_cast<unsigned>(secs);
+      // A CBR (Info) file's rate is the one in its frame headers.
+      out.bitrate = vbr && secs > 0 ? static_cast<unsigned>(audio_bytes * 8 / secs / 1000 + 0.5) : f->kbps;
+    } else {
+      out.bitrate = f->kbps;
+      out.length = static_cast<unsigned>(double(size - pos) * 8 / (f->kbps * 1000.0));
+    }
+    return true;
+  }
+  return false;
+}
+
+static bool parse_flac_streaminfo(ByteWindow &in, std::uint64_t data_start, TagFields &out) {
+  const unsigned char *m = in.get(data_start, 4 + 4 + 34);
+  if (!m || !std::equal(m, m + 4, "fLaC") || (m[4] & 0x7F) != 0) return false;
+  const unsigned char *d = m + 8;
+  const unsigned rate = (unsigned(d[10]) << 12) | (unsigned(d[11]) << 4) | (d[12] >> 4);
+  const unsigned bits = (((d[12] & 1u) << 4) | (d[13] >> 4)) + 1;
+  const std::uint64_t samples = (std::uint64_t(d[13] & 0x0F) << 32) | be32(d + 14);
+  if (rate == 0) return false;
+  // Only the frames count towards the bitrate: skip the metadata blocks up to the
+  // last-block flag (an embedded PICTURE is often several MB).
+  const std::uint64_t size = in.size();
+  std::uint64_t frames_start = data_start + 4;
+  for (bool last = false; !last;) {
+    const unsigned char *b = in.get(frames_start, 4);
+    if (!b) {
+      frames_start = size;
+      break;
+    }
+    last = (b[0] & 0x80) != 0;
+    frames_start += 4 + ((std::uint64_t(b[1]) << 16) | (std::uint64_t(b[2]) << 8) | b[3]);
+  }
+  const double audio_bytes = frames_start < size ? double(size - frames_start) : 0;
+  const double secs = double(samples) / rate;
+  out.has_audio = true;
+  out.format = std::to_string(bits) + "bit";
+  out.length = static_cast<unsigned>(secs);
+  out.bitrate = secs > 0 ? static_cast<unsigned>(audio_bytes * 8 / secs / 1000 + 0.5) : 0;
+  return true;
+}
+
+static bool read_audio_props(ByteWindow &in, bool flac, TagFields &out) {
+  if (!in.ok()) return false;
+  auto id3 = id3v2_tag_size(in);
+  if (!id3) return false;
+  return flac ? parse_flac_streaminfo(in, *id3, out) : parse_mpeg_audio(in, *id3, out);
+}
+
+// Index values: CBR bitrates as they are (always an MPEG table rate), others to
+// the nearest 16 kbps and, above 500 kbps (lossless), to the nearest 100; lengths
+// of the sampled track in ranges.
+static std::string bitrate_value(unsigned kbps, bool cbr) {
+  if (kbps == 0) return "Unknown";
+  if (cbr) return std::to_string(kbps);
+  const unsigned step = kbps >= 500 ? 100 : 16;
+  return std::to_string((kbps + step / 2) / step * step);
+}
+
+static std::string length_value(unsigned secs) {
+  static constexpr std::pair<unsigned, const char *> kRanges[] = {
+      {2 * 60, "00-02min"}, {5 * 60, "02-05min"}, {10 * 60, "05-10min"}, {30 * 60, "10-30min"}, {60 * 60, "30-60min"}};
+  for (const auto &[below, name] : kRanges) {
+    if (secs < below) return name;
+  }
+  return "60min+";
+}
+
+// ---- tag cache ----
+//
+// A release moved to another section (`mv recent/x archive/x`) keeps its files'
+// inodes and mtimes but not its path, so the path-keyed incremental state sees a
+// new release. With TAG_CACHE=true the tags of every file read are also kept by
+// file identity (device, inode, size, mtime), and read_release_info answers from
+// that before opening the file. When the identity is unknown (a copy, another
+// filesystem) a hash of the first 64 KiB, where ID3v2/FLAC tags live, plus the
+// last 4 KiB (ID3v1/APE) and the size is tried next. Entries not used for
+// kTagCacheDays days are dropped when the cache is saved.
+
+// Also what the incremental state compares (see state_entry_matches).
+struct FileIdentity {
+  std::uint64_t dev = 0;
+  std::uint64_t ino = 0;
+  std::uint64_t size = 0;
+  std::int64_t mtime_ns = 0;
+
+  bool operator==(const FileIdentity &) const = default;
+};
+
+struct FileIdentityHash {
+  std::size_t operator()(const FileIdentity &k) const {
+    std::uint64_t h = k.dev * 0x9e3779b97f4a7c15ULL ^ k.ino;
+    h = (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL ^ static_cast<std::uint64_t>(k.mtime_ns);
+    return static_cast<std::size_t>((h ^ (h >> 32)) + k.size);
+  }
+};
+
+static std::optional<FileIdentity> stat_identity(const fs::path &p) {
+  struct stat st {};
+  if (::stat(p.c_str(), &st) != 0) return std::nullopt;
+  FileIdentity id;
+  id.dev = static_cast<std::uint64_t>(st.st_dev);
+  id.ino = static_cast<std::uint64_t>(st.st_ino);
+  id.size = static_cast<std::uint64_t>(st.st_size);
+  id.mtime_ns = stat_mtime_ns(st);
+  return id;
+}
+
+// Word-wise 64-bit hash of the head and tail of a file, 0 if it can't be read.
+// Read through the tag reader's window: the tail first, so the window is left on
+// the head that read_tags_fast parses next.
+static std::uint64_t content_hash(ByteWindow &in, std::uint64_t size) {
+  static constexpr std::size_t kTail = 4096;
+  if (!in.ok() || size == 0) return 0;
+  unsigned char tail[kTail];
+  std::size_t tail_len = 0;
+  if (size > ByteWindow::kWindow) {
+    const std::uint64_t off = std::max<std::uint64_t>(size - kTail, ByteWindow::kWindow);
+    tail_len = static_cast<std::size_t>(size - off);
+    if (const unsigned char *p = in.get(off, tail_len)) std::memcpy(tail, p, tail_len);
+    else tail_len = 0;
+  }
+  const std::size_t head_len = static_cast<std::size_t>(std::min<std::uint64_t>(size, ByteWindow::kWindow));
+  const unsigned char *head = in.get(0, head_len);
+  if (!head) return 0;
+
+  std::uint64_t h = 0xcbf29ce484222325ULL ^ size;
+  auto mix = [&h](const unsigned char *p, std::size_t len) {
+    std::size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+      std::uint64_t w;
+      std::memcpy(&w, p + i, 8);
+      h = (h ^ w) * 0x100000001b3ULL;
+      h ^= h >> 31;
+    }
+    for (; i < len; ++i) h = (h ^ p[i]) * 0x100000001b3ULL;
+  };
+  mix(head, head_len);
+  mix(tail, tail_len);
+  return h ? h : 1;
+}
+
+static std::int64_t epoch_day() {
+  using namespace std::chrono;
+  return duration_cast<hours>(system_clock::now().time_since_epoch()).count() / 24;
+}
+
+class TagCache {
+ public:
+  static constexpr std::int64_t kTagCacheDays = 30;
+
+  struct Entry {
+    TagFields tags;
+    std::uint64_t content = 0;  // 0: not hashed (seeded from state)
+    std::int64_t used_day = 0;
+  };
+
+  void enable(bool on) { enabled_ = on; }
+  bool enabled() const { return enabled_; }
+
+  // With `audio`, entries stored without audio properties are misses.
+  std::optional<TagFields> find(const FileIdentity &key, bool audio) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = by_id_.find(key);
+    if (it == by_id_.end()) return std::nullopt;
+    it->second.used_day = today_;
+    if (audio && !it->second.tags.has_audio) return std::nullopt;
+    return it->second.tags;
+  }
+
+  // After a miss by identity: the same content under another identity.
+  std::optional<TagFields> find_content(const FileIdentity &key, std::uint64_t content, bool audio) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto c = by_content_.find(content);
+    if (c == by_content_.end()) return std::nullopt;
+    auto it = by_id_.find(c->second);
+    if (it == by_id_.end() || it->first.size != key.size) return std::nullopt;
+    if (audio && !it->second.tags.has_audio) return std::nullopt;
+    Entry e = it->second;
+    e.used_day = today_;
+    insert(key, e);
+    return e.tags;
+  }
+
+  void put(const FileIdentity &key, const TagFields &tags, std::uint64_t content) {
+    std::lock_guard<std::mutex> lock(mu_);
+    insert(key, Entry{tags, content, today_});
+  }
+
+  // Unchanged releases skip read_release_info; keep their entries alive, and
+  // add ones for files read before the cache was turned on.
+  void touch(const FileIdentity &key, const TagFields *seed) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = by_id_.find(key);
+    if (it != by_id_.end()) {
+      it->second.used_day = today_;
+    } else if (seed) {
+      insert(key, Entry{*seed, 0, today_});
+    }
+  }
+
+  void restore(const FileIdentity &key, Entry e) { insert(key, std::move(e)); }
+
+  template <class Fn>
+  void for_each(Fn &&fn) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto &[key, e] : by_id_) {
+      if (today_ - e.used_day <= kTagCacheDays) fn(key, e);
+    }
+  }
+
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return by_id_.size();
+  }
+
+  void set_today(std::int64_t day) {
+    std::lock_guard<std::mutex> lock(mu_);
+    today_ = day;
+  }
+
+ private:
+  void insert(const FileIdentity &key, Entry e) {
+    if (e.content) by_content_[e.content] = key;
+    by_id_[key] = std::move(e);
+  }
+
+  bool enabled_ = false;
+  std::int64_t today_ = 0;
+  mutable std::mutex mu_;
+  std::unordered_map<FileIdentity, Entry, FileIdentityHash> by_id_;
+  std::unordered_map<std::uint64_t, FileIdentity> by_content_;
+};
+
+static TagCache g_tags;
+
+static std::optional<ReleaseInfo> read_release_info(const fs::path &audio_file,
+                                                    const fs::path &release_dir,
+                                                    bool fast_tags,
+                                                    bool audio) {
+  StageTimer timer(Stage::TagRead);
+  const std::uint64_t bytes_before = t_read_bytes;
+  // Only opening the file counts against TAG_READ_IOPS; a tag cache hit by
+  // identity costs one stat.
+  bool acquired = false;
+  std::chrono::steady_clock::time_point start;
+  auto acquire = [&] {
+    if (acquired || !g_io.enabled()) return;
+    g_io.acquire();
+    acquired = true;
+    start = std::chrono::steady_clock::now();
+  };
+  std::optional<TagFields> tags;
+  std::optional<FileIdentity> key;
+  std::uint64_t content = 0;
+  std::optional<ByteWindow> in;
+  if (g_tags.enabled() && (key = stat_identity(audio_file)) && !(tags = g_tags.find(*key, audio))) {
+    acquire();
+    in.emplace(audio_file);
+    if ((content = content_hash(*in, key->size))) tags = g_tags.find_content(*key, content, audio);
+  }
+  if (tags) {
+    g_metrics.tag_cache_hits.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    const bool flac = has_ext(audio_file, ".flac");
+    acquire();
+    if ((fast_tags || audio) && !in) in.emplace(audio_file);
+    if (fast_tags) tags = read_tags_fast(*in, flac);
+    TagFields props;
+    const bool have_props = audio && read_audio_props(*in, flac, props);
+    if (tags) {
+      g_metrics.tag_fast_path.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      tags = read_tags_taglib(audio_file, audio && !have_props);
+      if (tags && tags->has_audio) tags->format = "Unknown";
+      g_metrics.tag_taglib.fetch_add(1, std::memory_order_relaxed);
+      // TagLib's reads aren't seen; count one window (the tag area) for it.
+      t_read_bytes += ByteWindow::kWindow;
+    }
+    if (tags && have_props) {
+      tags->has_audio = true;
+      tags->bitrate = props.bitrate;
+      tags->length = props.length;
+      tags->format = props.format;
+    }
+    if (tags && key) g_tags.put(*key, *tags, content);
+  }
+  const std::uint64_t bytes = t_read_bytes - bytes_before;
+  g_metrics.tag_read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  if (acquired) g_io.release(std::chrono::steady_clock::now() - start, bytes);
+  if (!tags) {
+    g_metrics.tag_parse_failures.fetch_add(1, std::memory_order_relaxed);
+    return std::nullopt;
+  }
+
+  ReleaseInfo info;
+  info.release_dir = release_dir;
+  info.release_name = info.release_dir.filename().string();
+
+  info.artist = sanitize_component(tags->artist);
+  info.album  = sanitize_component(tags->album);
+  info.genre = sanitize_component(tags->genre);
+
+  unsigned int y = tags->year;
+  info.year = (y > 0) ? std::to_string(y) : "Unknown";
+
+  // group: substring after last '-' in release_name
+  auto pos = info.release_name.find_last_of('-');
+  if (pos != std::string::npos && pos + 1 < info.release_name.size()) {
+    info.group = sanitize_component(info.release_name.substr(pos + 1));
+  } else {
+    info.group = "Unknown";
+  }
+
+  // alpha: first character (A-Z, 0-9); otherwise '#'
+  char c = info.release_name.empty() ? '#' : info.release_name[0];
+  c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+  info.alpha = (std::isalnum(static_cast<unsigned char>(c)) ? c : '#');
+
+  if (audio) {
+    info.bitrate = tags->has_audio ? bitrate_value(tags->bitrate, tags->format == "CBR") : "Unknown";
+    info.format = tags->has_audio && !tags->format.empty() ? sanitize_component(tags->format) : "Unknown";
+    info.length = tags->has_audio ? length_value(tags->length) : "Unknown";
+  }
+  return info;
+}
+
+// ---- release table ----
+//
+// With incremental state, reconcile and watch mode every release of the archive is
+// held in memory. Instead of a ReleaseInfo (eight strings) per release, releases
+// are stored column-wise: tag values that repeat across releases ("Unknown", the
+// same genre, group or year) are interned per field and referenced by 32-bit ids,
+// and all release paths share one character buffer.
+
+using ReleaseId = std::uint32_t;
+
+class StringDict {
+ public:
+  std::uint32_t id(std::string_view s) {
+    auto it = ids_.find(s);
+    if (it != ids_.end()) return it->second;
+    std::string_view stored = arena_.store(s);
+    const auto id = static_cast<std::uint32_t>(values_.size());
+    values_.push_back(stored);
+    ids_.emplace(stored, id);
+    return id;
+  }
+
+  std::string_view str(std::uint32_t id) const { return values_[id]; }
+  std::size_t size() const { return values_.size(); }
+
+ private:
+  StringArena arena_;
+  std::vector<std::string_view> values_;
+  std::unordered_map<std::string_view, std::uint32_t> ids_;
+};
+
+class ReleaseTable {
+ public:
+  enum Field { Artist, Album, Genre, Year, Group, Bitrate, Format, Length, kFields };
+
+  ReleaseId add(const ReleaseInfo &info) {
+    const auto row = static_cast<ReleaseId>(alpha_.size());
+    paths_ += info.release_dir.native();
+    path_end_.push_back(paths_.size());
+    cols_[Artist].push_back(dicts_[Artist].id(info.artist));
+    cols_[Album].push_back(dicts_[Album].id(info.album));
+    cols_[Genre].push_back(dicts_[Genre].id(info.genre));
+    cols_[Year].push_back(dicts_[Year].id(info.year));
+    cols_[Group].push_back(dicts_[Group].id(info.group));
+    cols_[Bitrate].push_back(dicts_[Bitrate].id(info.bitrate));
+    cols_[Format].push_back(dicts_[Format].id(info.format));
+    cols_[Length].push_back(dicts_[Length].id(info.length));
+    alpha_.push_back(info.alpha);
+    return row;
+  }
+
+  ReleaseInfo get(ReleaseId row) const {
+    ReleaseInfo info;
+    info.release_dir = std::string(release_dir(row));
+    info.release_name = info.release_dir.filename().string();
+    info.artist = value(Artist, row);
+    info.album = value(Album, row);
+    info.genre = value(Genre, row);
+    info.year = value(Year, row);
+    info.group = value(Group, row);
+    info.bitrate = value(Bitrate, row);
+    info.format = value(Format, row);
+    info.length = value(Length, row);
+    info.alpha = alpha_[row];
+    return info;
+  }
+
+  std::size_t size() const { return alpha_.size(); }
+
+  std::string_view release_dir(ReleaseId row) const {
+    const std::size_t begin = row ? path_end_[row - 1] : 0;
+    return std::string_view(paths_).substr(begin, path_end_[row] - begin);
+  }
+  std::uint32_t id(Field f, ReleaseId row) const { return cols_[f][row]; }
+  std::string_view value(Field f, ReleaseId row) const { return dicts_[f].str(cols_[f][row]); }
+  const StringDict &dict(Field f) const { return dicts_[f]; }
+  char alpha(ReleaseId row) const { return alpha_[row]; }
+
+ private:
+  std::string paths_;
+  std::vector<std::size_t> path_end_;
+  std::array<std::vector<std::uint32_t>, kFields> cols_;
+  std::array<StringDict, kFields> dicts_;
+  std::vector<char> alpha_;
+};
+
+// ---- incremental scan state ----
+//
+// One line per release directory. The directory's inode/mtime and the audio file
+// the tags were read from (size/mtime) identify "unchanged"; the remaining fields
+// are the ReleaseInfo extracted last time.
+
+struct StateEntry {
+  std::uint64_t dir_ino = 0;
+  std::int64_t dir_mtime_ns = 0;
+  fs::path audio_file;
+  std::uint64_t file_size = 0;
+  std::int64_t file_mtime_ns = 0;
+  // Row in the owning run's ReleaseTable.
+  ReleaseId release = 0;
+};
+
+using ScanState = std::unordered_map<std::string, StateEntry, StringHash, std::equal_to<>>;
+
+static const char *const kStateHeader = "mp3flac-indexer-state 1";
+
+static fs::path state_file_path(const Config &cfg, const std::string &type) {
+  return cfg.index_root / ".mp3flac-state" / (type + ".state");
+}
+
+// Paths may legally contain tabs/newlines; tag values are already sanitized.
+static std::string state_escape(const std::string &s) {
+  std::string out;
+  out.reserve(s.size());
+  for (char ch : s) {
+    if (ch == '\\') out += "\\\\";
+    else if (ch == '\t') out += "\\t";
+    else if (ch == '\n') out += "\\n";
+    else out.push_back(ch);
+  }
+  return out;
+}
+
+static std::string state_unescape(const std::string &s) {
+  std::string out;
+  out.reserve(s.size());
+  for (std::size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '\\' && i + 1 < s.size()) {
+      char n = s[++i];
+      out.push_back(n == 't' ? '\t' : n == 'n' ? '\n' : n);
+    } else {
+      out.push_back(s[i]);
+    }
+  }
+  return out;
+}
+
+static std::vector<std::string> split_tabs(const std::string &line) {
+  std::vector<std::string> out;
+  std::size_t start = 0;
+  while (true) {
+    auto pos = line.find('\t', start);
+    out.push_back(line.substr(start, pos - start));
+    if (pos == std::string::npos) break;
+    start = pos + 1;
+  }
+  return out;
+}
+
+static ScanState load_state(const fs::path &path, ReleaseTable &releases) {
+  ScanState state;
+  std::ifstream in(path);
+  if (!in) return state;
+
+  std::string line;
+  if (!std::getline(in, line) || line != kStateHeader) {
+    std::cerr << "[warn] ignoring state file with unknown format: " << path << "\n";
+    return state;
+  }
+
+  while (std::getline(in, line)) {
+    auto f = split_tabs(line);
+    // 16 fields with the audio-property values, 13 from before they existed.
+    if (f.size() != 13 && f.size() != 16) continue;
+    try {
+      StateEntry e;
+      e.dir_ino = std::stoull(f[1]);
+      e.dir_mtime_ns = std::stoll(f[2]);
+      e.audio_file = state_unescape(f[3]);
+      e.file_size = std::stoull(f[4]);
+      e.file_mtime_ns = std::stoll(f[5]);
+      ReleaseInfo info;
+      info.release_dir = state_unescape(f[6]);
+      info.artist = f[7];
+      info.album = f[8];
+      info.genre = f[9];
+      info.year = f[10];
+      info.group = f[11];
+      info.alpha = f[12].empty() ? '#' : f[12][0];
+      if (f.size() == 16) {
+        info.bitrate = f[13];
+        info.format = f[14];
+        info.length = f[15];
+      }
+      e.release = releases.add(info);
+      state[state_unescape(f[0])] = std::move(e);
+    } catch (...) {
+      continue;
+    }
+  }
+  return state;
+}
+
+static void save_state(const fs::path &path, const ScanState &state, const ReleaseTable &releases, bool dry_run) {
+  if (dry_run) return;
+  std::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+  if (ec) {
+    throw std::runtime_error("Cannot create directory: " + path.parent_path().string() + " (" + ec.message() + ")");
+  }
+
+  // Write-then-rename so an interrupted run never leaves a truncated state file.
+  fs::path tmp = path;
+  tmp += ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    if (!out) throw std::runtime_error("Cannot write state file: " + tmp.string());
+    out << kStateHeader << "\n";
+    for (const auto &[key, e] : state) {
+      out << state_escape(key) << '\t'
+          << e.dir_ino << '\t' << e.dir_mtime_ns << '\t'
+          << state_escape(e.audio_file.string()) << '\t'
+          << e.file_size << '\t' << e.file_mtime_ns << '\t'
+          << state_escape(std::string(releases.release_dir(e.release))) << '\t'
+          << releases.value(ReleaseTable::Artist, e.release) << '\t'
+          << releases.value(ReleaseTable::Album, e.release) << '\t'
+          << releases.value(ReleaseTable::Genre, e.release) << '\t'
+          << releases.value(ReleaseTable::Year, e.release) << '\t'
+          << releases.value(ReleaseTable::Group, e.release) << '\t'
+          << releases.alpha(e.release) << '\t'
+          << releases.value(ReleaseTable::Bitrate, e.release) << '\t'
+          << releases.value(ReleaseTable::Format, e.release) << '\t'
+          << releases.value(ReleaseTable::Length, e.release) << '\n';
+    }
+    if (!out) throw std::runtime_error("Cannot write state file: " + tmp.string());
+  }
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    throw std::runtime_error("Cannot replace state file: " + path.string() + " (" + ec.message() + ")");
+  }
+}
+
+static const char *const kTagCacheHeader = "mp3flac-indexer-tags 1";
+
+static fs::path tag_cache_path(const Config &cfg) { return cfg.index_root / ".mp3flac-state" / "tags.cache"; }
+
+static void load_tag_cache(const fs::path &path, TagCache &cache) {
+  std::ifstream in(path);
+  if (!in) return;
+  std::string line;
+  if (!std::getline(in, line) || line != kTagCacheHeader) {
+    std::cerr << "[warn] ignoring tag cache with unknown format: " << path << "\n";
+    return;
+  }
+  while (std::getline(in, line)) {
+    auto f = split_tabs(line);
+    // 14 fields with audio properties, 10 from before they existed.
+    if (f.size() != 10 && f.size() != 14) continue;
+    try {
+      FileIdentity key{std::stoull(f[0]), std::stoull(f[1]), std::stoull(f[2]), std::stoll(f[3])};
+      TagCache::Entry e;
+      e.content = std::stoull(f[4]);
+      e.used_day = std::stoll(f[5]);
+      e.tags.artist = state_unescape(f[6]);
+      e.tags.album = state_unescape(f[7]);
+      e.tags.genre = state_unescape(f[8]);
+      e.tags.year = static_cast<unsigned>(std::stoul(f[9]));
+      if (f.size() == 14) {
+        e.tags.has_audio = f[10] == "1";
+        e.tags.bitrate = static_cast<unsigned>(std::stoul(f[11]));
+        e.tags.length = static_cast<unsigned>(std::stoul(f[12]));
+        e.tags.format = state_unescape(f[13]);
+      }
+      cache.restore(key, std::move(e));
+    } catch (...) {
+      continue;
+    }
+  }
+}
+
+static void save_tag_cache(const fs::path &path, const TagCache &cache, bool dry_run) {
+  if (dry_run) return;
+  std::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+  if (ec) {
+    throw std::runtime_error("Cannot create directory: " + path.parent_path().string() + " (" + ec.message() + ")");
+  }
+  fs::path tmp = path;
+  tmp += ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    if (!out) throw std::runtime_error("Cannot write tag cache: " + tmp.string());
+    out << kTagCacheHeader << "\n";
+    cache.for_each([&](const FileIdentity &k, const TagCache::Entry &e) {
+      out << k.dev << '\t' << k.ino << '\t' << k.size << '\t' << k.mtime_ns << '\t'
+          << e.content << '\t' << e.used_day << '\t'
+          << state_escape(e.tags.artist) << '\t' << state_escape(e.tags.album) << '\t'
+          << state_escape(e.tags.genre) << '\t' << e.tags.year << '\t'
+          << (e.tags.has_audio ? 1 : 0) << '\t' << e.tags.bitrate << '\t' << e.tags.length << '\t'
+          << state_escape(e.tags.format) << '\n';
+    });
+    if (!out) throw std::runtime_error("Cannot write tag cache: " + tmp.string());
+  }
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    throw std::runtime_error("Cannot replace tag cache: " + path.string() + " (" + ec.message() + ")");
+  }
+}
+
+// Returns true if neither the release directory nor the audio file we read the
+// tags from changed since the entry was recorded.
+static bool state_entry_matches(const StateEntry &e,
+                                const std::optional<FileIdentity> &dir,
+                                const std::optional<FileIdentity> &file) {
+  if (!dir || dir->ino != e.dir_ino || dir->mtime_ns != e.dir_mtime_ns) return false;
+  return file && file->size == e.file_size && file->mtime_ns == e.file_mtime_ns;
+}
+
+// Keep the cache entry of an unchanged release's audio file in use. With a single
+// sample the recorded tags are that file's own, so a missing entry is filled in
+// (not with audio properties: the state only has their bucketed index values).
+static void touch_tag_cache(const FileIdentity &key, const ReleaseInfo &info, const Config &cfg) {
+  if (cfg.tag_samples > 1 || cfg.audio_props) {
+    g_tags.touch(key, nullptr);
+    return;
+  }
+  TagFields tags;
+  tags.artist = info.artist;
+  tags.album = info.album;
+  tags.genre = info.genre;
+  tags.year = info.year == "Unknown" ? 0u : static_cast<unsigned>(std::strtoul(info.year.c_str(), nullptr, 10));
+  g_tags.touch(key, &tags);
+}
+
+// ---- batched stat ----
+//
+// The incremental check stats every release directory and its recorded audio file.
+// On network storage each stat is a round trip, so the walker collects them in
+// batches and StatBatch keeps a whole batch in flight at once: through io_uring
+// (IORING_OP_STATX) when built with MP3FLAC_IO_URING and the kernel allows it,
+// otherwise one stat() after the other.
+
+struct StatRequest {
+  const fs::path *path = nullptr;
+  std::optional<FileIdentity> result;
+};
+
+#if MP3FLAC_IO_URING
+class StatBatch {
+ public:
+  explicit StatBatch(unsigned depth = 128) {
+    io_uring_params p{};
+    int fd = static_cast<int>(::syscall(__NR_io_uring_setup, depth, &p));
+    if (fd < 0) return;  // seccomp, io_uring_disabled, old kernel: plain stat()
+    fd_ = fd;
+    sq_entries_ = p.sq_entries;
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    sq_ring_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    cq_ring_ = single ? sq_ring_
+                      : ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                               IORING_OFF_CQ_RING);
+    sqes_ = static_cast<io_uring_sqe *>(::mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+    if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+      close_ring();
+      return;
+    }
+    auto *sq = static_cast<char *>(sq_ring_);
+    auto *cq = static_cast<char *>(cq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+  }
+
+  StatBatch(const StatBatch &) = delete;
+  StatBatch &operator=(const StatBatch &) = delete;
+  ~StatBatch() { close_ring(); }
+
+  void run(std::vector<StatRequest> &reqs) {
+    std::size_t done = 0;
+    while (fd_ >= 0 && done < reqs.size()) {
+      std::size_t n = std::min<std::size_t>(reqs.size() - done, sq_entries_);
+      if (!submit_chunk(reqs.data() + done, n)) break;
+      done += n;
+    }
+    for (; done < reqs.size(); ++done) reqs[done].result = stat_identity(*reqs[done].path);
+  }
+
+ private:
+  // Submit `n` statx requests and wait for all of them. Returns false (nothing
+  // consumed) if the ring can't be used, after which everything goes to stat().
+  bool submit_chunk(StatRequest *reqs, std::size_t n) {
+    bufs_.resize(n);
+    unsigned tail = *sq_tail_;
+    for (std::size_t i = 0; i < n; ++i) {
+      unsigned idx = (tail + static_cast<unsigned>(i)) & sq_mask_;
+      io_uring_sqe &sqe = sqes_[idx];
+      std::memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = IORING_OP_STATX;
+      sqe.fd = AT_FDCWD;
+      sqe.addr = reinterpret_cast<std::uint64_t>(reqs[i].path->c_str());
+      sqe.len = STATX_INO | STATX_SIZE | STATX_MTIME;
+      sqe.off = reinterpret_cast<std::uint64_t>(&bufs_[i]);
+      sqe.user_data = i;
+      sq_array_[idx] = idx;
+    }
+    __atomic_store_n(sq_tail_, tail + static_cast<unsigned>(n), __ATOMIC_RELEASE);
+
+    std::size_t submitted = 0, reaped = 0;
+    while (reaped < n) {
+      unsigned to_submit = static_cast<unsigned>(n - submitted);
+      long ret = ::syscall(__NR_io_uring_enter, fd_, to_submit, 1u, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+        // Entries already in the ring still complete; wait for those, then give up.
+        if (submitted == 0) {
+          __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+          close_ring();
+          return false;
+        }
+        break;
+      }
+      submitted += static_cast<std::size_t>(ret);
+      unsigned head = *cq_head_;
+      unsigned ctail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != ctail; ++head, ++reaped) {
+        const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+        StatRequest &r = reqs[cqe.user_data];
+        if (cqe.res == 0) {
+          const struct statx &sx = bufs_[cqe.user_data];
+          FileIdentity id;
+          id.dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+          id.ino = sx.stx_ino;
+          id.size = sx.stx_size;
+          id.mtime_ns = static_cast<std::int64_t>(sx.stx_mtime.tv_sec) * 1000000000LL + sx.stx_mtime.tv_nsec;
+          r.result = id;
+        } else if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+          // Kernel without IORING_OP_STATX.
+          r.result = stat_identity(*r.path);
+          unsupported_ = true;
+        } else {
+          r.result = std::nullopt;
+        }
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+    if (unsupported_ || reaped < n) close_ring();
+    if (reaped < n) {
+      for (std::size_t i = 0; i < n; ++i) reqs[i].result = stat_identity(*reqs[i].path);
+    }
+    return true;
+  }
+
+  void close_ring() {
+    if (sqes_ && sqes_ != MAP_FAILED) ::munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+    if (cq_ring_ && cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_size_);
+    if (sq_ring_ && sq_ring_ != MAP_FAILED) ::munmap(sq_ring_, sq_size_);
+    sqes_ = nullptr;
+    sq_ring_ = cq_ring_ = nullptr;
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+  }
+
+  int fd_ = -1;
+  unsigned sq_entries_ = 0;
+  std::size_t sq_size_ = 0, cq_size_ = 0;
+  void *sq_ring_ = nullptr;
+  void *cq_ring_ = nullptr;
+  io_uring_sqe *sqes_ = nullptr;
+  unsigned *sq_tail_ = nullptr, *sq_array_ = nullptr, sq_mask_ = 0;
+  unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr, cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+  std::vector<struct statx> bufs_;
+  bool unsupported_ = false;
+};
+#else
+class StatBatch {
+ public:
+  explicit StatBatch(unsigned = 0) {}
+  void run(std::vector<StatRequest> &reqs) {
+    for (StatRequest &r : reqs) r.result = stat_identity(*r.path);
+  }
+};
+#endif
+
+// ---- tag-reading worker pool ----
+
+// Runs `fn` over submitted jobs on N worker threads and hands the results to a
+// sink on the submitting thread, in submission order. At most `capacity` jobs are
+// outstanding, so one slow release can't make the walker buffer the whole tree.
+// With fewer than two threads everything runs inline.
+template <class Job, class Result>
+class OrderedPool {
+ public:
+  using Fn = std::function<Result(const Job &)>;
+
+  OrderedPool(unsigned threads, std::size_t capacity, Fn fn)
+      : fn_(std::move(fn)), capacity_(std::max<std::size_t>(capacity, 1)) {
+    if (threads > 1) {
+      for (unsigned i = 0; i < threads; ++i) workers_.emplace_back([this] { worker_loop(); });
+    }
+  }
+
+  OrderedPool(const OrderedPool &) = delete;
+  OrderedPool &operator=(const OrderedPool &) = delete;
+
+  ~OrderedPool() {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      stop_ = true;
+    }
+    job_cv_.notify_all();
+    for (auto &t : workers_) t.join();
+  }
+
+  template <class Sink>
+  void submit(Job job, Sink &&sink) {
+    if (workers_.empty()) {
+      sink(fn_(job));
+      return;
+    }
+    wait_for_room(sink);
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      jobs_.emplace_back(next_seq_++, std::move(job));
+    }
+    job_cv_.notify_one();
+  }
+
+  // Queue a result that needs no work, keeping it in order with pooled ones.
+  template <class Sink>
+  void submit_ready(Result r, Sink &&sink) {
+    if (workers_.empty()) {
+      sink(std::move(r));
+      return;
+    }
+    wait_for_room(sink);
+    std::lock_guard<std::mutex> lk(mu_);
+    done_[next_seq_++].result = std::move(r);
+  }
+
+  // Wait for all outstanding jobs and deliver their results.
+  template <class Sink>
+  void drain(Sink &&sink) {
+    while (next_out_ < next_seq_) deliver_next(sink, true);
+  }
+
+ private:
+  struct Slot {
+    std::optional<Result> result;
+    std::exception_ptr error;
+  };
+
+  template <class Sink>
+  void wait_for_room(Sink &sink) {
+    while (deliver_next(sink, false)) {}
+    while (next_seq_ - next_out_ >= capacity_) deliver_next(sink, true);
+  }
+
+  // Deliver the next in-order result; returns false if `block` is false and it
+  // isn't finished yet.
+  template <class Sink>
+  bool deliver_next(Sink &sink, bool block) {
+    Slot slot;
+    {
+      std::unique_lock<std::mutex> lk(mu_);
+      auto it = done_.find(next_out_);
+      if (it == done_.end()) {
+        if (!block) return false;
+        done_cv_.wait(lk, [&] { return (it = done_.find(next_out_)) != done_.end(); });
+      }
+      slot = std::move(it->second);
+      done_.erase(it);
+    }
+    ++next_out_;
+    if (slot.error) std::rethrow_exception(slot.error);
+    sink(std::move(*slot.result));
+    return true;
+  }
+
+  void worker_loop() {
+    while (true) {
+      std::pair<std::size_t, Job> item;
+      {
+        std::unique_lock<std::mutex> lk(mu_);
+        job_cv_.wait(lk, [&] { return stop_ || !jobs_.empty(); });
+        if (stop_) return;
+        item = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      Slot slot;
+      try {
+        slot.result = fn_(item.second);
+      } catch (...) {
+        slot.error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        done_[item.first] = std::move(slot);
+      }
+      done_cv_.notify_one();
+    }
+  }
+
+  Fn fn_;
+  std::size_t capacity_;
+  std::vector<std::thread> workers_;
+
+  std::mutex mu_;
+  std::condition_variable job_cv_;
+  std::condition_variable done_cv_;
+  std::deque<std::pair<std::size_t, Job>> jobs_;
+  std::unordered_map<std::size_t, Slot> done_;
+  bool stop_ = false;
+
+  // Only touched by the submitting thread.
+  std::size_t next_seq_ = 0;
+  std::size_t next_out_ = 0;
+};
+
+static void ensure_dir(const fs::path &p, bool dry_run) {
+  if (dry_run) return;
+  std::error_code ec;
+  fs::create_directories(p, ec);
+  if (ec) {
+    throw std::runtime_error("Cannot create directory: " + p.string() + " (" + ec.message() + ")");
+  }
+}
+
+// Per-run cache for the index side of a scan:
+//  - directories known to exist, so ensure() doesn't stat every path component of
+//    index/<type>/<category>/<value> again for each link;
+//  - a bounded LRU of open directory fds, so a link costs one symlinkat() relative
+//    to its parent instead of a full path lookup;
+//  - canonical forms of link directories and the current release target, which
+//    relative link targets are computed from.
+// Not thread-safe; one instance per writing thread.
+class IndexDirs {
+ public:
+  explicit IndexDirs(std::size_t max_fds = 256) : max_fds_(std::max<std::size_t>(max_fds, 1)) {}
+  IndexDirs(const IndexDirs &) = delete;
+  IndexDirs &operator=(const IndexDirs &) = delete;
+  ~IndexDirs() {
+    for (auto &kv : fds_) ::close(kv.second.fd);
+  }
+
+  void ensure(const std::string &dir, bool dry_run) {
+    if (dry_run || known_.count(dir)) return;
+    ensure_dir(dir, false);
+    known_.insert(dir);
+  }
+
+  // Open fd for `dir`, or -1 (errno set).
+  int fd(const std::string &dir) {
+    auto it = fds_.find(dir);
+    if (it != fds_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+      return it->second.fd;
+    }
+    int d = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d < 0) return -1;
+    if (fds_.size() >= max_fds_) {
+      auto old = fds_.find(lru_.back());
+      ::close(old->second.fd);
+      fds_.erase(old);
+      lru_.pop_back();
+    }
+    lru_.push_front(dir);
+    fds_.emplace(dir, FdEntry{d, lru_.begin()});
+    return d;
+  }
+
+  // `dir` was removed.
+  void forget(const std::string &dir) {
+    known_.erase(dir);
+    canonical_.erase(dir);
+    auto it = fds_.find(dir);
+    if (it != fds_.end()) {
+      ::close(it->second.fd);
+      lru_.erase(it->second.lru);
+      fds_.erase(it);
+    }
+  }
+
+  // What a link in directory `link_dir` should point to: relative to that
+  // directory if requested (as fs::relative computes it), falling back to the
+  // absolute target when that fails.
+  fs::path link_target(const fs::path &target_abs, const std::string &link_dir, bool relative) {
+    if (!relative) return target_abs;
+    std::error_code ec;
+    if (target_abs != last_target_) {
+      last_target_canon_ = fs::weakly_canonical(target_abs, ec);
+      if (ec) return target_abs;
+      last_target_ = target_abs;
+    }
+    auto it = canonical_.find(link_dir);
+    if (it == canonical_.end()) {
+      fs::path c = fs::weakly_canonical(fs::path(link_dir), ec);
+      if (ec) return target_abs;
+      it = canonical_.emplace(link_dir, std::move(c)).first;
+    }
+    fs::path rel = last_target_canon_.lexically_relative(it->second);
+    return rel.empty() ? target_abs : rel;
+  }
+
+ private:
+  struct FdEntry {
+    int fd;
+    std::list<std::string>::iterator lru;
+  };
+
+  std::size_t max_fds_;
+  std::unordered_set<std::string> known_;
+  std::unordered_map<std::string, FdEntry> fds_;
+  std::list<std::string> lru_;
+  std::unordered_map<std::string, fs::path> canonical_;
+  fs::path last_target_;
+  fs::path last_target_canon_;
+};
+
+// Split "dir/name" at the last separator.
+static std::string parent_of(const std::string &link_path) {
+  std::size_t slash = link_path.rfind('/');
+  return slash == std::string::npos ? std::string(".") : link_path.substr(0, slash);
+}
+
+// Create `link_path` (= `dir` + '/' + name) -> `target` with one symlinkat()
+// relative to the cached fd of `dir`. An existing entry is replaced only if
+// `replace`. Returns false if the link was left alone.
+static bool put_symlink(IndexDirs &dirs,
+                        const fs::path &target,
+                        const std::string &dir,
+                        const std::string &link_path,
+                        bool replace) {
+  StageTimer timer(Stage::Symlink);
+  const char *name = link_path.c_str() + dir.size() + 1;
+  auto fail = [&](const std::string &what) { return std::runtime_error(what + " (" + std::strerror(errno) + ")"); };
+  int dfd = dirs.fd(dir);
+  if (dfd < 0) throw fail("symlink failed: " + link_path + " -> " + target.string());
+  if (::symlinkat(target.c_str(), dfd, name) == 0) {
+    g_metrics.symlinks_created.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  if (errno != EEXIST) throw fail("symlink failed: " + link_path + " -> " + target.string());
+  if (!replace) {
+    g_metrics.symlinks_kept.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  if (::unlinkat(dfd, name, 0) != 0) throw fail("Cannot remove existing link: " + link_path);
+  if (::symlinkat(target.c_str(), dfd, name) != 0) {
+    throw fail("symlink failed: " + link_path + " -> " + target.string());
+  }
+  g_metrics.symlinks_created.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+static bool remove_link(IndexDirs &dirs, const std::string &dir, const std::string &link_path, std::error_code &ec) {
+  int dfd = dirs.fd(dir);
+  if (dfd < 0 || ::unlinkat(dfd, link_path.c_str() + dir.size() + 1, 0) != 0) {
+    ec = std::error_code(errno, std::generic_category());
+    return false;
+  }
+  return true;
+}
+
+static bool create_or_replace_symlink(const fs::path &target_abs,
+                                     const std::string &dir,
+                                     const std::string &link_path,
+                                     bool relative,
+                                     bool force,
+                                     bool dry_run,
+                                     IndexDirs &dirs) {
+  fs::path target = dirs.link_target(target_abs, dir, relative);
+  if (dry_run) {
+    std::error_code ec;
+    return force || fs::symlink_status(link_path, ec).type() == fs::file_type::not_found;
+  }
+  return put_symlink(dirs, target, dir, link_path, force);
+}
+
+// A link that can't be written (EIO/ESTALE from NFS, ENOSPC, a value directory
+// that can't be created) is reported and counted, and the run goes on; the next
+// run retries it since every indexed release is linked again.
+static constexpr std::uint64_t kMaxLinkWarnings = 100;
+
+static void link_error(const std::exception &e) {
+  const std::uint64_t n = g_metrics.symlink_errors.fetch_add(1, std::memory_order_relaxed);
+  if (n < kMaxLinkWarnings) std::cerr << std::string("[warn] ") + e.what() + "\n";
+  else if (n == kMaxLinkWarnings) std::cerr << "[warn] further link errors not shown\n";
+}
+
+static void clean_index_tree(const fs::path &base, bool dry_run) {
+  if (dry_run) return;
+  StageTimer timer(Stage::Clean);
+  std::error_code ec;
+  if (fs::exists(base, ec)) {
+    for (auto it = fs::directory_iterator(base, ec); !ec && it != fs::directory_iterator(); ++it) {
+      fs::remove_all(it->path(), ec);
+      if (ec) break;
+    }
+  }
+  if (ec) {
+    throw std::runtime_error("Failed to clean index tree: " + base.string() + " (" + ec.message() + ")");
+  }
+}
+
+// ---- link manifest ----
+//
+// With INDEX_ROOT on another host's NFS export every link costs several
+// synchronous round trips. LINK_MANIFEST=/path collects the links index_release()
+// would create in a manifest instead, and `apply-links` (this binary, run on the
+// index host, e.g. through `ssh host mp3flac-indexer apply-links /srv/index`)
+// creates them there locally. One line per link after the header:
+//   R|K <tab> link path relative to INDEX_ROOT <tab> target
+// R replaces an existing entry, K keeps it; fields use the state file escaping.
+
+static const char *const kManifestHeader = "mp3flac-indexer-links 1";
+
+class LinkManifest {
+ public:
+  LinkManifest(fs::path path, const fs::path &index_root)
+      : path_(std::move(path)), prefix_(normal_dir(index_root).native()) {
+    if (!prefix_.empty() && prefix_.back() != '/') prefix_ += '/';
+    tmp_ = path_;
+    tmp_ += ".tmp";
+    out_.open(tmp_, std::ios::trunc);
+    if (!out_) throw std::runtime_error("Cannot write link manifest: " + tmp_.string());
+    out_ << kManifestHeader << "\n";
+  }
+
+  void add(const std::string &link_path, const fs::path &target, bool replace) {
+    std::string_view rel = link_path;
+    if (rel.compare(0, prefix_.size(), prefix_) == 0) rel.remove_prefix(prefix_.size());
+    out_ << (replace ? 'R' : 'K') << '\t' << state_escape(std::string(rel)) << '\t' << state_escape(target.string())
+         << '\n';
+    ++ops_;
+  }
+
+  std::uint64_t ops() const { return ops_; }
+  const fs::path &path() const { return path_; }
+
+  // Close the manifest and move it into place.
+  void finish() {
+    out_.close();
+    if (!out_) throw std::runtime_error("Cannot write link manifest: " + tmp_.string());
+    std::error_code ec;
+    fs::rename(tmp_, path_, ec);
+    if (ec) throw std::runtime_error("Cannot replace link manifest: " + path_.string() + " (" + ec.message() + ")");
+  }
+
+ private:
+  fs::path path_;
+  fs::path tmp_;
+  std::string prefix_;
+  std::ofstream out_;
+  std::uint64_t ops_ = 0;
+};
+
+// Run LINK_APPLY through the shell with the finished manifest on stdin.
+static void apply_manifest(const LinkManifest &manifest, const std::string &command) {
+  std::cout.flush();
+  std::cerr.flush();
+  pid_t pid = ::fork();
+  if (pid < 0) throw std::runtime_error(std::string("Cannot run LINK_APPLY (") + std::strerror(errno) + ")");
+  if (pid == 0) {
+    int fd = ::open(manifest.path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || ::dup2(fd, 0) < 0) ::_exit(127);
+    ::execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char *>(nullptr));
+    ::_exit(127);
+  }
+  int status = 0;
+  while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    const int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    throw std::runtime_error("LINK_APPLY failed (status " + std::to_string(code) + "): " + command);
+  }
+}
+
+// ---- link writer ----
+//
+// Link creation sharded by link directory. Every shard has one thread, its own
+// IndexDirs and a FIFO queue it takes over in batches, so a hot directory such as
+// alpha/S or genre/Electronic is only ever written by one thread (no contention
+// on its inode lock) and links with the same path are still created in
+// submission order, i.e. first release wins exactly as in a serial run. With one
+// shard links are created inline on the caller's IndexDirs.
+
+class LinkWriter {
+ public:
+  LinkWriter(IndexDirs &inline_dirs, unsigned shards, LinkManifest *manifest = nullptr)
+      : inline_dirs_(inline_dirs), manifest_(manifest) {
+    if (shards < 2 || manifest_) return;
+    for (unsigned i = 0; i < shards; ++i) shards_.push_back(std::make_unique<Shard>());
+    for (auto &s : shards_) s->thread = std::thread([this, sh = s.get()] { shard_loop(*sh); });
+  }
+
+  LinkWriter(const LinkWriter &) = delete;
+  LinkWriter &operator=(const LinkWriter &) = delete;
+
+  ~LinkWriter() {
+    for (auto &s : shards_) {
+      {
+        std::lock_guard<std::mutex> lk(s->m);
+        s->stop = true;
+      }
+      s->work.notify_all();
+    }
+    for (auto &s : shards_) s->thread.join();
+  }
+
+  void link(const fs::path &target_abs, const std::string &dir, const std::string &link, bool relative, bool force,
+            bool dry_run) {
+    g_status.add(Counter::LinksQueued);
+    if (manifest_) {
+      manifest_->add(link, inline_dirs_.link_target(target_abs, dir, relative), force);
+      g_status.add(Counter::LinksDone);
+      return;
+    }
+    if (shards_.empty()) {
+      try {
+        inline_dirs_.ensure(dir, dry_run);
+        (void)create_or_replace_symlink(target_abs, dir, link, relative, force, dry_run, inline_dirs_);
+      } catch (const std::runtime_error &e) {
+        link_error(e);
+      }
+      g_status.add(Counter::LinksDone);
+      return;
+    }
+    rethrow_if_failed();
+    Shard &s = *shards_[std::hash<std::string>{}(dir) % shards_.size()];
+    std::unique_lock<std::mutex> lk(s.m);
+    s.space.wait(lk, [&] { return s.queue.size() < kShardQueue; });
+    s.queue.push_back(Op{target_abs, dir, link, relative, force, dry_run});
+    if (s.queue.size() == 1) s.work.notify_one();
+  }
+
+  // Wait until every queued link is written; rethrows the first failure.
+  void drain() {
+    for (auto &s : shards_) {
+      std::unique_lock<std::mutex> lk(s->m);
+      s->idle.wait(lk, [&] { return s->queue.empty() && !s->busy; });
+    }
+    rethrow_if_failed();
+  }
+
+  // The caller's IndexDirs; only safe to use directly after drain().
+  IndexDirs &inline_dirs() { return inline_dirs_; }
+
+ private:
+  static constexpr std::size_t kShardQueue = 4096;
+
+  struct Op {
+    fs::path target;
+    std::string dir;
+    std::string link;
+    bool relative;
+    bool force;
+    bool dry_run;
+  };
+
+  struct Shard {
+    std::mutex m;
+    std::condition_variable work, space, idle;
+    std::vector<Op> queue;
+    bool busy = false;
+    bool stop = false;
+    IndexDirs dirs;
+    std::thread thread;
+  };
+
+  void shard_loop(Shard &s) {
+    std::vector<Op> batch;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lk(s.m);
+        s.work.wait(lk, [&] { return s.stop || !s.queue.empty(); });
+        if (s.queue.empty()) return;
+        batch.swap(s.queue);
+        s.busy = true;
+      }
+      s.space.notify_all();
+      for (const Op &op : batch) {
+        if (failed_.load(std::memory_order_relaxed)) break;
+        try {
+          s.dirs.ensure(op.dir, op.dry_run);
+          (void)create_or_replace_symlink(op.target, op.dir, op.link, op.relative, op.force, op.dry_run, s.dirs);
+        } catch (const std::runtime_error &e) {
+          link_error(e);
+        } catch (...) {
+          std::lock_guard<std::mutex> lk(error_m_);
+          if (!error_) error_ = std::current_exception();
+          failed_.store(true, std::memory_order_relaxed);
+        }
+      }
+      g_status.add(Counter::LinksDone, batch.size());
+      batch.clear();
+      {
+        std::lock_guard<std::mutex> lk(s.m);
+        s.busy = false;
+      }
+      s.idle.notify_all();
+    }
+  }
+
+  void rethrow_if_failed() {
+    if (!failed_.load(std::memory_order_relaxed)) return;
+    std::lock_guard<std::mutex> lk(error_m_);
+    std::rethrow_exception(error_);
+  }
+
+  IndexDirs &inline_dirs_;
+  LinkManifest *manifest_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<bool> failed_{false};
+  std::mutex error_m_;
+  std::exception_ptr error_;
+};
+
+// ---- atomic rebuild ----
+//
+// A staged category lives next to the live one (same depth, so relative symlinks
+// built in it stay valid after the swap): <INDEX_ROOT>/<type>/.<category>.rebuild
+
+static void append_category_dir(std::string &out, const fs::path &type_root, std::string_view cat, bool staged) {
+  out += type_root.native();
+  out += '/';
+  if (staged) out += '.';
+  out += cat;
+  if (staged) out += ".rebuild";
+}
+
+static fs::path category_dir(const fs::path &type_root, const std::string &cat, bool staged) {
+  std::string dir;
+  append_category_dir(dir, type_root, cat, staged);
+  return dir;
+}
+
+// Begin a rebuild of `cat`: drop whatever a previous interrupted rebuild left behind.
+static void prepare_staging(const fs::path &type_root, const std::string &cat, bool dry_run) {
+  if (dry_run) return;
+  fs::path staged = category_dir(type_root, cat, true);
+  std::error_code ec;
+  fs::remove_all(staged, ec);
+  if (!ec) fs::create_directories(staged, ec);
+  if (ec) {
+    throw std::runtime_error("Cannot prepare staging directory: " + staged.string() + " (" + ec.message() + ")");
+  }
+}
+
+// Swap the staged tree of `cat` in. Returns the path now holding the old tree
+// (to be deleted), or an empty path if there was none.
+static fs::path swap_in_staged(const fs::path &type_root, const std::string &cat, bool dry_run) {
+  if (dry_run) return {};
+  fs::path staged = category_dir(type_root, cat, true);
+  fs::path live = category_dir(type_root, cat, false);
+  std::error_code ec;
+
+  if (!fs::exists(live, ec)) {
+    fs::rename(staged, live, ec);
+    if (ec) throw std::runtime_error("Cannot move rebuilt tree into place: " + live.string() + " (" + ec.message() + ")");
+    return {};
+  }
+
+#ifdef RENAME_EXCHANGE
+  if (::renameat2(AT_FDCWD, staged.c_str(), AT_FDCWD, live.c_str(), RENAME_EXCHANGE) == 0) return staged;
+  if (errno != EINVAL && errno != ENOSYS) {
+    throw std::runtime_error("Cannot swap rebuilt tree: " + live.string() + " (" + std::strerror(errno) + ")");
+  }
+#endif
+
+  // Filesystem without RENAME_EXCHANGE: two renames, the category is missing
+  // for the moment in between.
+  fs::path old = type_root / ("." + cat + ".old");
+  fs::remove_all(old, ec);
+  ec.clear();
+  fs::rename(live, old, ec);
+  if (!ec) fs::rename(staged, live, ec);
+  if (ec) throw std::runtime_error("Cannot swap rebuilt tree: " + live.string() + " (" + ec.message() + ")");
+  return old;
+}
+
+// Delete replaced trees without holding up the caller: a low-priority child
+// process does the remove_all so the run (and cron) can finish right away. Falls
+// back to deleting inline if fork() fails. Must be called with no other threads
+// running.
+static void remove_in_background(const std::vector<fs::path> &paths) {
+  if (paths.empty()) return;
+  std::cout.flush();
+  std::cerr.flush();
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    // Detach from the parent's output so whoever waits on it isn't held up.
+    int devnull = ::open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+      ::dup2(devnull, 0);
+      ::dup2(devnull, 1);
+      ::dup2(devnull, 2);
+    }
+    ::setsid();
+    ::setpriority(PRIO_PROCESS, 0, 19);
+    for (const auto &p : paths) {
+      std::error_code ec;
+      fs::remove_all(p, ec);
+    }
+    ::_exit(0);
+  }
+  if (pid < 0) {
+    for (const auto &p : paths) {
+      std::error_code ec;
+      fs::remove_all(p, ec);
+      if (ec) std::cerr << "[warn] cannot remove old index tree: " << p << " (" << ec.message() << ")\n";
+    }
+  }
+}
+
+// ---- fan-out ----
+//
+// FANOUT_THRESHOLD=N: once a category value directory (groups/Unknown,
+// genre/Electronic, ...) gets more than N releases in a run, its links move one
+// level down into buckets: the release name's first letter (FANOUT=alpha;
+// A-Z, 0-9, #) or two hex digits of its hash (FANOUT=hash). A `.fanout` marker in
+// the value directory keeps the layout for later runs and watch mode.
+
+static const char *const kFanoutMarker = ".fanout";
+
+class FanOut {
+ public:
+  // Also starts counting afresh.
+  void configure(std::size_t threshold, bool hash) {
+    threshold_ = threshold;
+    hash_ = hash;
+    dirs_.clear();
+    crossed_.clear();
+  }
+
+  bool enabled() const { return threshold_ > 0; }
+
+  // Bucket for `release_name` in `value_dir` of category `cat`, or "" to link it
+  // flat. With `count`, the release counts towards the threshold.
+  std::string_view place(const std::string &value_dir, Category cat, std::string_view release_name, bool count) {
+    if (!enabled() || (!hash_ && cat == Category::Alpha)) return {};
+    auto [it, inserted] = dirs_.try_emplace(value_dir);
+    if (inserted) {
+      std::error_code ec;
+      it->second.fanned = fs::exists(fs::path(value_dir) / kFanoutMarker, ec);
+    }
+    Dir &d = it->second;
+    if (!d.fanned && count && ++d.count > threshold_) {
+      d.fanned = true;
+      crossed_.push_back(value_dir);
+    }
+    return d.fanned ? bucket(release_name) : std::string_view{};
+  }
+
+  std::string_view bucket(std::string_view release_name) {
+    if (hash_) {
+      std::uint32_t h = 2166136261u;  // FNV-1a
+      for (char c : release_name) h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+      static const char kHex[] = "0123456789abcdef";
+      buf_[0] = kHex[(h >> 4) & 0xf];
+      buf_[1] = kHex[h & 0xf];
+      return std::string_view(buf_, 2);
+    }
+    unsigned char c = release_name.empty() ? '#' : static_cast<unsigned char>(release_name[0]);
+    buf_[0] = std::isalnum(c) ? static_cast<char>(std::toupper(c)) : '#';
+    return std::string_view(buf_, 1);
+  }
+
+  // Value directories that went over the threshold since the last call.
+  std::vector<std::string> take_crossed() { return std::exchange(crossed_, {}); }
+
+ private:
+  struct Dir {
+    std::size_t count = 0;
+    bool fanned = false;
+  };
+
+  std::size_t threshold_ = 0;
+  bool hash_ = false;
+  std::unordered_map<std::string, Dir> dirs_;
+  std::vector<std::string> crossed_;
+  char buf_[2] = {};
+};
+
+static void write_fanout_marker(const std::string &value_dir) {
+  std::ofstream(fs::path(value_dir) / kFanoutMarker, std::ios::trunc);
+}
+
+// `value_dir` just went over the threshold: move the links lying directly in it
+// into their buckets (relative targets gain one "../") and mark it.
+static void fan_out_dir(const std::string &value_dir, FanOut &fanout, bool dry_run, IndexDirs &dirs) {
+  if (dry_run) return;
+  std::vector<std::pair<std::string, fs::path>> flat;
+  std::error_code ec;
+  for (fs::directory_iterator it(value_dir, ec), end; !ec && it != end; it.increment(ec)) {
+    std::error_code lec;
+    if (!it->is_symlink(lec)) continue;
+    fs::path target = fs::read_symlink(it->path(), lec);
+    if (!lec) flat.emplace_back(it->path().filename().string(), std::move(target));
+  }
+  for (auto &[name, target] : flat) {
+    const std::string bucket_dir = value_dir + "/" + std::string(fanout.bucket(name));
+    const std::string link = bucket_dir + "/" + name;
+    if (target.is_relative()) target = fs::path("..") / target;
+    try {
+      dirs.ensure(bucket_dir, false);
+      put_symlink(dirs, target, bucket_dir, link, false);
+    } catch (const std::runtime_error &e) {
+      link_error(e);
+      continue;  // keep the flat link
+    }
+    std::error_code rec;
+    if (!remove_link(dirs, value_dir, value_dir + "/" + name, rec)) {
+      std::cerr << "[warn] cannot remove link after fan-out: " << fs::path(value_dir) / name << " (" << rec.message()
+                << ")\n";
+    }
+  }
+  write_fanout_marker(value_dir);
+}
+
+static std::string_view category_value(Category cat, const ReleaseInfo &info) {
+  switch (cat) {
+    case Category::Alpha: return std::string_view(&info.alpha, 1);
+    case Category::Genre: return info.genre;
+    case Category::Year: return info.year;
+    case Category::Artist: return info.artist;
+    case Category::Album: return info.album;
+    case Category::Groups: return info.group;
+    case Category::Bitrate: return info.bitrate;
+    case Category::Format: return info.format;
+    case Category::Length: return info.length;
+    case Category::kCount: break;
+  }
+  return {};
+}
+
+// Call `fn(dir, link, target_abs)` for every link `info` gets in `indexes`. With
+// `fanout`, links of fanned-out value directories go into their bucket; `count`
+// counts the release towards the threshold (false when removing links).
+template <class Fn>
+static void for_each_release_link(const fs::path &type_root,
+                                  const ReleaseInfo &info,
+                                  CategoryMask indexes,
+                                  bool staged,
+                                  FanOut *fanout,
+                                  bool count,
+                                  Fn &&fn) {
+  fs::path abs_dir;
+  const fs::path &target = info.release_dir.is_absolute() ? info.release_dir
+                                                          : (abs_dir = fs::absolute(info.release_dir));
+
+  // fn(dir, link, target): `link` is `dir` + '/' + release name. Both buffers are
+  // reused for every link of the release.
+  std::string dir, link;
+  auto add_index = [&](Category cat, std::string_view subdir) {
+    dir.clear();
+    append_category_dir(dir, type_root, kCategoryDirs[static_cast<std::size_t>(cat)], staged);
+    dir += '/';
+    dir += subdir;
+    if (fanout) {
+      std::string_view bucket = fanout->place(dir, cat, info.release_name, count);
+      if (!bucket.empty()) {
+        dir += '/';
+        dir += bucket;
+      }
+    }
+    link.assign(dir);
+    link += '/';
+    link += info.release_name;
+    fn(static_cast<const std::string &>(dir), static_cast<const std::string &>(link), target);
+  };
+
+  for (std::size_t c = 0; c < kNumCategories; ++c) {
+    const auto cat = static_cast<Category>(c);
+    if (indexes & category_bit(cat)) add_index(cat, category_value(cat, info));
+  }
+}
+
+static void index_release(const std::string &type,
+                          const ReleaseInfo &info,
+                          const Config &cfg,
+                          CategoryMask indexes,
+                          bool force,
+                          bool dry_run,
+                          LinkWriter &links,
+                          bool staged = false,
+                          FanOut *fanout = nullptr) {
+  for_each_release_link(cfg.index_root / type, info, indexes, staged, fanout, true,
+                        [&](const std::string &dir, const std::string &link, const fs::path &target) {
+    links.link(target, dir, link, cfg.relative_symlinks, force, dry_run);
+  });
+  if (!fanout) return;
+  for (const std::string &dir : fanout->take_crossed()) {
+    links.drain();
+    fan_out_dir(dir, *fanout, dry_run, links.inline_dirs());
+  }
+}
+
+// ---- reconcile ----
+//
+// Instead of touching every link of every release, collect the desired links
+// (path -> target) during the scan, read what the index tree holds, and apply
+// only the difference.
+
+using LinkMap = std::unordered_map<std::string, std::string>;
+
+struct ReconcileStats {
+  std::size_t added = 0;
+  std::size_t retargeted = 0;
+  std::size_t removed = 0;
+  std::size_t unchanged = 0;
+};
+
+// All symlinks below `dir` (not following them), as link path -> target.
+static void read_index_links(const fs::path &dir, LinkMap &out) {
+  std::error_code ec;
+  if (!fs::exists(dir, ec)) return;
+  for (fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+       it != end; it.increment(ec)) {
+    if (ec) {
+      ec.clear();
+      continue;
+    }
+    std::error_code lec;
+    if (!it->is_symlink(lec)) continue;
+    fs::path target = fs::read_symlink(it->path(), lec);
+    if (!lec) out.emplace(it->path().string(), target.string());
+  }
+}
+
+// Bring `category_dirs` in line with `desired`. Stale links are only removed when
+// `allow_removals` (i.e. every scan root was reachable); directories emptied by a
+// removal are removed too.
+static ReconcileStats reconcile_links(const std::vector<fs::path> &category_dirs,
+                                      const LinkMap &desired,
+                                      bool allow_removals,
+                                      bool dry_run,
+                                      IndexDirs &dirs) {
+  StageTimer timer(Stage::Reconcile);
+  LinkMap existing;
+  for (const auto &dir : category_dirs) read_index_links(dir, existing);
+
+  ReconcileStats st;
+  for (const auto &[link, target] : desired) {
+    auto it = existing.find(link);
+    if (it != existing.end() && it->second == target) {
+      ++st.unchanged;
+      continue;
+    }
+    const fs::path link_path(link);
+    std::error_code ec;
+    if (it == existing.end() && fs::symlink_status(link_path, ec).type() != fs::file_type::not_found) {
+      std::cerr << "[warn] not replacing non-symlink in index: " << link_path << "\n";
+      continue;
+    }
+    if (it != existing.end()) ++st.retargeted;
+    else ++st.added;
+    if (dry_run) continue;
+
+    const std::string dir = parent_of(link);
+    try {
+      dirs.ensure(dir, false);
+      put_symlink(dirs, target, dir, link, it != existing.end());
+    } catch (const std::runtime_error &e) {
+      link_error(e);
+    }
+  }
+
+  if (!allow_removals) return st;
+  for (const auto &[link, target] : existing) {
+    if (desired.count(link)) continue;
+    ++st.removed;
+    if (dry_run) continue;
+    const std::string parent = parent_of(link);
+    std::error_code ec;
+    if (!remove_link(dirs, parent, link, ec)) {
+      std::cerr << "[warn] cannot remove stale link: " << fs::path(link) << " (" << ec.message() << ")\n";
+      continue;
+    }
+    // Drop the value directory (e.g. genre/OldGenre) once it is empty; never the
+    // category itself.
+    if (std::none_of(category_dirs.begin(), category_dirs.end(),
+                     [&](const fs::path &c) { return c.native() == parent; }) &&
+        fs::is_empty(parent, ec) && !ec) {
+      dirs.forget(parent);
+      fs::remove(parent, ec);
+    }
+  }
+  return st;
+}
+
+// Reconcile mode: links collected before their directory went over the threshold
+// still use the flat layout; move them into their buckets. Returns the directories
+// that went over the threshold (they get their marker once the links are applied).
+static std::vector<std::string> fan_out_desired(LinkMap &desired, FanOut &fanout) {
+  std::vector<std::string> crossed = fanout.take_crossed();
+  if (crossed.empty()) return crossed;
+  std::unordered_set<std::string> fanned(crossed.begin(), crossed.end());
+  LinkMap out;
+  out.reserve(desired.size());
+  for (auto &[link, target] : desired) {
+    const std::string dir = parent_of(link);
+    if (!fanned.count(dir)) {
+      out.emplace(link, std::move(target));
+      continue;
+    }
+    const std::string name = link.substr(dir.size() + 1);
+    std::string moved = dir + "/" + std::string(fanout.bucket(name)) + "/" + name;
+    out.emplace(std::move(moved), (!target.empty() && target[0] != '/') ? "../" + target : std::move(target));
+  }
+  desired.swap(out);
+  return crossed;
+}
+
+struct RunOptions {
+  bool force = false;
+  bool clean = false;
+  bool dry_run = false;
+  // With `clean`: build into staging trees and swap them in at the end.
+  bool atomic_rebuild = false;
+  bool reconcile = false;
+  // Ignore the incremental state and re-read every release (state is still rewritten).
+  bool full_rescan = false;
+  // Continue an interrupted run from its checkpoint.
+  bool resume = false;
+  // Scan window (see ScanWindow): SCAN_WINDOW_DAYS, or --since YYYY-MM-DD.
+  int window_days = 0;
+  std::string since;
+};
+
+// Everything one media type carries through a scan.
+struct TypeRun {
+  std::string type;
+  std::string ext;
+  int release_depth = 1;
+  std::vector<fs::path> roots;
+  CategoryMask indexes = 0;
+
+  fs::path state_path;
+  ScanState prev_state;
+  ReleaseTable prev_releases;
+  // Whether a state file for this type existed; see scan_group().
+  bool prev_state_loaded = false;
+  ScanState next_state;
+  // Every release indexed in this run; next_state and `indexed` point into it.
+  ReleaseTable releases;
+  // Interned release keys (see g_release_keys).
+  std::unordered_set<std::string_view> seen_release_dirs;
+
+  // Categories are being rebuilt in staging trees (atomic rebuild).
+  bool staged = false;
+  // Reconcile mode: links the scan wants, applied after the scan.
+  LinkMap desired_links;
+  FanOut fanout;
+  // False if a scan root was missing; reconcile then keeps stale links.
+  bool roots_complete = true;
+  // Watch mode: remember what each release was indexed as, so its links can be
+  // removed or moved when it changes.
+  bool keep_indexed = false;
+  std::unordered_map<std::string, ReleaseId, StringHash, std::equal_to<>> indexed;
+
+  std::size_t files_seen = 0;
+  std::size_t releases_indexed = 0;
+  std::size_t releases_from_state = 0;
+  std::size_t releases_outside_window = 0;
+};
+
+// Types that share a scan root at the same release depth are walked together.
+struct ScanGroup {
+  fs::path root;
+  int release_depth = 1;
+  std::vector<TypeRun *> types;
+};
+
+struct TypeResult {
+  std::optional<ReleaseInfo> info;
+  // Filled in (audio_file non-empty) when the release should go into the state.
+  StateEntry entry;
+  // Matching audio files looked at while resolving the release.
+  std::size_t files_seen = 0;
+  bool from_state = false;
+};
+
+struct ReleaseResult {
+  // Interned; empty if the release directory had no usable absolute path.
+  std::string_view release_key;
+  // One per type of the scan group.
+  std::vector<TypeResult> types;
+};
+
+// A release found by the walker. `audio_file` is set when the walker already saw
+// a matching file (shallow releases); otherwise the job looks for one itself.
+// `want[i]` says whether the group's i-th type still needs its tags read; the
+// other types' results (from the incremental state) are already in `seed`.
+struct ReleaseJob {
+  fs::path release_dir;
+  fs::path audio_file;
+  // A directory above the release depth that holds audio files directly (e.g.
+  // tracks lying in the scan root) is a release made of just those files; its
+  // subdirectories belong to other releases.
+  bool shallow = false;
+  bool track_state = false;
+  std::vector<bool> want;
+  ReleaseResult seed;
+};
+
+// posix_fadvise(WILLNEED) for the head of the file; a no-op where the platform
+// has no posix_fadvise (macOS).
+static void fadvise_willneed([[maybe_unused]] int fd, [[maybe_unused]] off_t len) {
+#ifdef POSIX_FADV_WILLNEED
+  (void)::posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+// Start fetching the head of `p` (where the tags live) in the background, so the
+// samples of a release are read from storage together instead of one
+// round trip after the other.
+static void prefetch_head(const fs::path &p) {
+  int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  fadvise_willneed(fd, ByteWindow::kWindow);
+  ::close(fd);
+}
+
+static bool same_tags(const ReleaseInfo &a, const ReleaseInfo &b) {
+  return a.artist == b.artist && a.album == b.album && a.genre == b.genre && a.year == b.year;
+}
+
+// Per field, the most common value among the samples; "Unknown" only wins when
+// no sample has anything else, and ties go to the earlier sample.
+static ReleaseInfo tag_consensus(const std::vector<ReleaseInfo> &samples) {
+  ReleaseInfo out = samples.front();
+  for (std::string ReleaseInfo::*field : {&ReleaseInfo::artist, &ReleaseInfo::album, &ReleaseInfo::genre,
+                                          &ReleaseInfo::year}) {
+    std::size_t best = 0;
+    for (const ReleaseInfo &s : samples) {
+      const std::string &v = s.*field;
+      if (v == "Unknown") continue;
+      std::size_t n = 0;
+      for (const ReleaseInfo &o : samples) n += (o.*field == v) ? 1 : 0;
+      if (n > best) {
+        best = n;
+        out.*field = v;
+      }
+    }
+  }
+  return out;
+}
+
+// Read tags for every wanted type of a release in a single listing of the
+// release that stops as soon as all wanted types are resolved. With
+// TAG_SAMPLES=1 a type is resolved by the first matching audio file that parses.
+// With K > 1 up to K files are sampled (fetched together, see prefetch_head) and
+// each tag field takes the majority value; sampling stops early once a majority
+// of K samples agree on every field.
+static ReleaseResult read_release_job(const ReleaseJob &job,
+                                      const std::vector<const std::string *> &exts,
+                                      fs::directory_options opts,
+                                      const Config &cfg) {
+  const std::size_t ntypes = exts.size();
+  const std::size_t k = std::max(cfg.tag_samples, 1u);
+  ReleaseResult r = job.seed;
+  r.types.resize(ntypes);
+  std::vector<fs::path> tagged(ntypes);
+  std::vector<std::vector<ReleaseInfo>> samples(ntypes);
+  std::vector<std::vector<fs::path>> queued(ntypes);
+  std::vector<bool> done(ntypes);
+  std::size_t pending = 0;
+  for (std::size_t i = 0; i < ntypes; ++i) {
+    done[i] = !job.want[i];
+    pending += done[i] ? 0 : 1;
+  }
+
+  auto decided = [&](std::size_t i) {
+    const std::vector<ReleaseInfo> &s = samples[i];
+    if (s.size() >= k) return true;
+    const std::size_t majority = k / 2 + 1;
+    for (const ReleaseInfo &a : s) {
+      std::size_t n = 0;
+      for (const ReleaseInfo &b : s) n += same_tags(a, b) ? 1 : 0;
+      if (n >= majority) return true;
+    }
+    return false;
+  };
+  // Read the queued files of type i, in listing order.
+  auto flush = [&](std::size_t i) {
+    if (queued[i].size() > 1) {
+      for (const fs::path &p : queued[i]) prefetch_head(p);
+    }
+    for (const fs::path &p : queued[i]) {
+      if (done[i]) break;
+      ++r.types[i].files_seen;
+      auto info = read_release_info(p, job.release_dir, cfg.fast_tags, cfg.audio_props);
+      if (!info) continue;
+      if (samples[i].empty()) tagged[i] = p;
+      samples[i].push_back(std::move(*info));
+      if (decided(i)) {
+        done[i] = true;
+        --pending;
+      }
+    }
+    queued[i].clear();
+  };
+  auto slots = [&](std::size_t i) { return done[i] ? 0 : k - samples[i].size() - queued[i].size(); };
+  auto wanted_type = [&](const fs::path &p) -> std::optional<std::size_t> {
+    for (std::size_t i = 0; i < ntypes; ++i) {
+      if (slots(i) > 0 && has_ext(p, *exts[i])) return i;
+    }
+    return std::nullopt;
+  };
+  // Read as soon as a type has a full batch queued.
+  auto add_file = [&](std::size_t i, const fs::path &p) {
+    queued[i].push_back(p);
+    if (slots(i) == 0) flush(i);
+  };
+  auto try_entry = [&](const fs::directory_entry &ent) {
+    std::error_code ec;
+    if (ent.path() == job.audio_file) return;
+    auto i = wanted_type(ent.path());
+    if (i && ent.is_regular_file(ec)) add_file(*i, ent.path());
+  };
+
+  if (!job.audio_file.empty()) {
+    if (auto i = wanted_type(job.audio_file)) add_file(*i, job.audio_file);
+  }
+
+  if (pending > 0) {
+    std::error_code ec;
+    if (job.shallow) {
+      for (fs::directory_iterator it(job.release_dir, opts, ec), end; pending > 0 && it != end; it.increment(ec)) {
+        if (ec) break;
+        try_entry(*it);
+      }
+    } else {
+      for (fs::recursive_directory_iterator it(job.release_dir, opts, ec), end; pending > 0 && it != end; it.increment(ec)) {
+        if (ec) break;
+        try_entry(*it);
+      }
+    }
+  }
+
+  for (std::size_t i = 0; i < ntypes; ++i) {
+    flush(i);
+    if (!samples[i].empty()) r.types[i].info = samples[i].size() == 1 ? samples[i][0] : tag_consensus(samples[i]);
+  }
+
+  if (job.track_state) {
+    auto dir_id = stat_identity(job.release_dir);
+    for (std::size_t i = 0; i < exts.size(); ++i) {
+      TypeResult &t = r.types[i];
+      if (!job.want[i] || !t.info || !dir_id) continue;
+      auto file_id = stat_identity(tagged[i]);
+      if (!file_id) continue;
+      t.entry.dir_ino = dir_id->ino;
+      t.entry.dir_mtime_ns = dir_id->mtime_ns;
+      t.entry.audio_file = tagged[i];
+      t.entry.file_size = file_id->size;
+      t.entry.file_mtime_ns = file_id->mtime_ns;
+    }
+  }
+  return r;
+}
+
+// ---- prefetch ----
+//
+// Tag reads are small reads at the start of each file, and on spinning disks they
+// cost a seek each. With PREFETCH_DISTANCE=N the scanning thread holds N releases
+// back before handing them to the readers, while a prefetch thread lists those
+// releases, picks the files the readers will open (up to TAG_SAMPLES per wanted
+// type, in listing order) and asks the kernel for their first PREFETCH_KB KiB with
+// posix_fadvise(WILLNEED). Each batch is issued in order of the files' physical
+// position (FIEMAP, where the filesystem reports it), so the disk serves it in one
+// sweep; files without a known position keep their listing order after those.
+
+class Prefetcher {
+ public:
+  Prefetcher(std::size_t distance, std::size_t bytes, std::size_t samples, std::vector<const std::string *> exts,
+             fs::directory_options opts)
+      : distance_(distance), bytes_(bytes), samples_(std::max<std::size_t>(samples, 1)), exts_(std::move(exts)),
+        opts_(opts) {
+    if (distance_ > 0) thread_ = std::thread([this] { loop(); });
+  }
+
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher &operator=(const Prefetcher &) = delete;
+
+  ~Prefetcher() {
+    if (!thread_.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  bool enabled() const { return distance_ > 0; }
+  std::size_t distance() const { return distance_; }
+
+  // Release `seq` (in submission order) will be read soon.
+  void add(std::size_t seq, const fs::path &release_dir, const fs::path &first_file, bool shallow,
+           const std::vector<bool> &want) {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      queue_.push_back(Item{seq, release_dir, first_file, shallow, want});
+    }
+    cv_.notify_one();
+  }
+
+  // Releases before `seq` went to the readers; prefetching them is no use now.
+  void handed_over(std::size_t seq) { handed_over_.store(seq, std::memory_order_relaxed); }
+
+ private:
+  struct Item {
+    std::size_t seq;
+    fs::path release_dir;
+    fs::path first_file;
+    bool shallow;
+    std::vector<bool> want;
+  };
+
+  struct Head {
+    int fd;
+    std::uint64_t physical;
+  };
+
+  void loop() {
+    g_io.apply_io_class();
+    std::deque<Item> batch;
+    std::vector<fs::path> files;
+    std::vector<Head> heads;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait(lk, [&] { return stop_ || !queue_.empty(); });
+        if (stop_) return;
+        batch.swap(queue_);
+      }
+      files.clear();
+      for (const Item &item : batch) {
+        if (item.seq >= handed_over_.load(std::memory_order_relaxed)) candidates(item, files);
+      }
+      batch.clear();
+
+      heads.clear();
+      for (const fs::path &p : files) {
+        int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) heads.push_back(Head{fd, physical_offset(fd)});
+      }
+      std::stable_sort(heads.begin(), heads.end(),
+                       [](const Head &a, const Head &b) { return a.physical < b.physical; });
+      for (const Head &h : heads) {
+        fadvise_willneed(h.fd, static_cast<off_t>(bytes_));
+        ::close(h.fd);
+      }
+    }
+  }
+
+  // The files read_release_job() will open first, found the same way.
+  void candidates(const Item &item, std::vector<fs::path> &out) const {
+    std::vector<std::size_t> left(exts_.size());
+    std::size_t pending = 0;
+    for (std::size_t i = 0; i < exts_.size(); ++i) {
+      left[i] = item.want[i] ? samples_ : 0;
+      pending += left[i];
+    }
+    auto take = [&](const fs::path &p) {
+      for (std::size_t i = 0; i < exts_.size(); ++i) {
+        if (left[i] > 0 && has_ext(p, *exts_[i])) {
+          out.push_back(p);
+          --left[i];
+          --pending;
+          return;
+        }
+      }
+    };
+    if (!item.first_file.empty()) take(item.first_file);
+    auto visit = [&](const fs::directory_entry &ent) {
+      std::error_code ec;
+      if (ent.path() != item.first_file && ent.is_regular_file(ec)) take(ent.path());
+    };
+    std::error_code ec;
+    if (item.shallow) {
+      for (fs::directory_iterator it(item.release_dir, opts_, ec), end; pending > 0 && it != end; it.increment(ec)) {
+        if (ec) break;
+        visit(*it);
+      }
+    } else {
+      for (fs::recursive_directory_iterator it(item.release_dir, opts_, ec), end; pending > 0 && it != end;
+           it.increment(ec)) {
+        if (ec) break;
+        visit(*it);
+      }
+    }
+  }
+
+  // Physical byte offset of the file's first extent; unknown sorts last.
+  static std::uint64_t physical_offset([[maybe_unused]] int fd) {
+    constexpr std::uint64_t kUnknown = ~std::uint64_t{0};
+#ifndef __linux__
+    return kUnknown;  // no FIEMAP: listing order
+#else
+    alignas(struct fiemap) unsigned char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+    auto *fm = reinterpret_cast<struct fiemap *>(buf);
+    fm->fm_start = 0;
+    fm->fm_length = 1;
+    fm->fm_extent_count = 1;
+    if (::ioctl(fd, FS_IOC_FIEMAP, fm) != 0 || fm->fm_mapped_extents == 0) return kUnknown;
+    const struct fiemap_extent &fe = fm->fm_extents[0];
+    if (fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE)) return kUnknown;
+    return fe.fe_physical;
+#endif
+  }
+
+  const std::size_t distance_;
+  const std::size_t bytes_;
+  const std::size_t samples_;
+  const std::vector<const std::string *> exts_;
+  const fs::directory_options opts_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<Item> queue_;
+  bool stop_ = false;
+  std::atomic<std::size_t> handed_over_{0};
+  std::thread thread_;
+};
+
+// Enumerate release directories under `root`: every directory exactly
+// `release_depth` levels down is a release, e.g.
+//   root/YYYY-MM-DD/<release>/...  => depth=2
+//   root/<release>/...             => depth=1
+// Directories above that depth are only listed, never stat'ed file by file; the
+// first file with one of `exts` directly inside one of them makes it a shallow
+// release (the old "fewer components than release_depth" case).
+// `emit(release_dir, first_audio_file_or_empty, shallow)` is called in walk order.
+// Top-level directories for which `skip(path)` is true are not entered.
+template <class Emit, class Skip>
+static void walk_releases(const fs::path &dir,
+                          int level,
+                          int release_depth,
+                          const std::vector<const std::string *> &exts,
+                          bool follow_symlinks,
+                          Emit &&emit,
+                          Skip &&skip) {
+  std::error_code ec;
+  bool shallow_emitted = false;
+  for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+       !ec && it != end; it.increment(ec)) {
+    const fs::directory_entry &ent = *it;
+    std::error_code tec;
+    // directory_entry caches the d_type from readdir, so these don't stat.
+    bool is_link = ent.is_symlink(tec);
+    if (ent.is_directory(tec) && (follow_symlinks || !is_link)) {
+      if (level == 0 && skip(ent.path())) continue;
+      if (level + 1 >= release_depth) emit(ent.path(), fs::path{}, false);
+      else walk_releases(ent.path(), level + 1, release_depth, exts, follow_symlinks, emit, skip);
+    } else if (!shallow_emitted &&
+               std::any_of(exts.begin(), exts.end(), [&](const std::string *e) { return has_ext(ent.path(), *e); }) &&
+               ent.is_regular_file(tec)) {
+      shallow_emitted = true;
+      emit(dir, ent.path(), true);
+    }
+  }
+}
+
+// ---- parallel walker ----
+//
+// WALK_THREADS=N (N > 1) lists the directories above the release depth on N
+// threads. Every directory to list is a task: a thread puts the subdirectories
+// it finds at the front of its own deque and works from there, and an idle
+// thread steals from the front of another thread's deque, so a date directory
+// with 500 releases next to one with 5 balances out and the next roots are
+// listed while the current one is indexed. The listings form a tree per root
+// that the scanning thread emits depth-first in directory order, i.e. exactly
+// the sequence walk_releases() produces, so seen_release_dirs and first-wins
+// link collisions stay on that thread without any locking. If the directory it
+// needs next hasn't been picked up yet it lists it itself. Listed but not yet
+// emitted directories are capped at kLookahead per thread.
+
+class ParallelWalker {
+  struct Node;
+
+ public:
+  using Skip = std::function<bool(const fs::path &)>;
+
+  struct Root {
+    ParallelWalker *walker;
+    int release_depth;
+    std::vector<const std::string *> exts;
+    bool follow_symlinks;
+    Skip skip;
+    std::shared_ptr<Node> top;
+
+    // Same contract as walk_releases(): `emit(release_dir, first_audio_file_or_empty,
+    // shallow)` in walk order, on the calling thread.
+    template <class Emit>
+    void walk(Emit &&emit) {
+      walker->emit_node(*top, emit);
+      top.reset();
+    }
+  };
+
+  explicit ParallelWalker(unsigned threads) : cap_(static_cast<std::size_t>(threads) * kLookahead) {
+    // Deque `threads` belongs to the scanning thread (directories it lists itself).
+    for (unsigned i = 0; i <= threads; ++i) deques_.push_back(std::make_unique<Deque>());
+    for (unsigned i = 0; i < threads; ++i) workers_.emplace_back([this, i] { work(i); });
+  }
+
+  ParallelWalker(const ParallelWalker &) = delete;
+  ParallelWalker &operator=(const ParallelWalker &) = delete;
+
+  ~ParallelWalker() {
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &t : workers_) t.join();
+  }
+
+  // Queue `root` for listing; roots are listed roughly in the order they are added.
+  // Top-level directories for which `skip` is true are not entered.
+  std::unique_ptr<Root> start(const fs::path &root,
+                              int release_depth,
+                              std::vector<const std::string *> exts,
+                              bool follow_symlinks,
+                              Skip skip) {
+    auto r = std::make_unique<Root>(Root{this, release_depth, std::move(exts), follow_symlinks, std::move(skip), nullptr});
+    r->top = std::make_shared<Node>(root, 0, r.get());
+    std::vector<std::shared_ptr<Node>> one{r->top};
+    push(deques_.size() - 1, one, false);
+    return r;
+  }
+
+ private:
+  static constexpr std::size_t kLookahead = 64;
+  enum : int { kPending, kRunning, kListed };
+
+  struct Item {
+    fs::path dir;
+    fs::path first_file;
+    bool shallow = false;
+    std::shared_ptr<Node> child;  // a directory above the release depth
+  };
+
+  struct Node {
+    Node(fs::path d, int l, const Root *r) : dir(std::move(d)), level(l), root(r) {}
+    fs::path dir;
+    int level;
+    const Root *root;
+    std::atomic<int> state{kPending};
+    std::vector<Item> items;
+  };
+
+  struct Deque {
+    std::mutex m;
+    std::deque<std::shared_ptr<Node>> tasks;
+  };
+
+  // Put `nodes` (in directory order) at the front of deque `d`, or at the back.
+  void push(std::size_t d, std::vector<std::shared_ptr<Node>> &nodes, bool front) {
+    if (nodes.empty()) return;
+    {
+      std::lock_guard<std::mutex> lk(deques_[d]->m);
+      auto &q = deques_[d]->tasks;
+      q.insert(front ? q.begin() : q.end(), nodes.begin(), nodes.end());
+    }
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      queued_ += nodes.size();
+    }
+    work_cv_.notify_all();
+  }
+
+  // Own deque first, then steal. Nodes the scanning thread already claimed are dropped.
+  std::shared_ptr<Node> take(std::size_t self) {
+    for (std::size_t i = 0; i < deques_.size(); ++i) {
+      Deque &d = *deques_[(self + i) % deques_.size()];
+      std::lock_guard<std::mutex> lk(d.m);
+      while (!d.tasks.empty()) {
+        std::shared_ptr<Node> n = std::move(d.tasks.front());
+        d.tasks.pop_front();
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        int expected = kPending;
+        if (n->state.compare_exchange_strong(expected, kRunning)) return n;
+      }
+    }
+    return nullptr;
+  }
+
+  void work(std::size_t self) {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lk(m_);
+        work_cv_.wait(lk, [&] { return stop_ || (queued_.load(std::memory_order_relaxed) > 0 && held_ < cap_); });
+        if (stop_) return;
+      }
+      if (std::shared_ptr<Node> n = take(self)) list(*n, self);
+    }
+  }
+
+  // The listing half of walk_releases(): releases and a shallow release become
+  // items, directories further up become child nodes (queued on deque `self`).
+  void list(Node &n, std::size_t self) {
+    const Root &r = *n.root;
+    std::vector<std::shared_ptr<Node>> children;
+    std::error_code ec;
+    bool shallow_emitted = false;
+    for (fs::directory_iterator it(n.dir, fs::directory_options::skip_permission_denied, ec), end;
+         !ec && it != end; it.increment(ec)) {
+      const fs::directory_entry &ent = *it;
+      std::error_code tec;
+      bool is_link = ent.is_symlink(tec);
+      if (ent.is_directory(tec) && (r.follow_symlinks || !is_link)) {
+        if (n.level == 0 && r.skip && r.skip(ent.path())) continue;
+        if (n.level + 1 >= r.release_depth) {
+          n.items.push_back(Item{ent.path(), {}, false, nullptr});
+        } else {
+          children.push_back(std::make_shared<Node>(ent.path(), n.level + 1, &r));
+          n.items.push_back(Item{{}, {}, false, children.back()});
+        }
+      } else if (!shallow_emitted &&
+                 std::any_of(r.exts.begin(), r.exts.end(), [&](const std::string *e) { return has_ext(ent.path(), *e); }) &&
+                 ent.is_regular_file(tec)) {
+        shallow_emitted = true;
+        n.items.push_back(Item{n.dir, ent.path(), true, nullptr});
+      }
+    }
+    push(self, children, true);
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      n.state.store(kListed);
+      if (n.level > 0) ++held_;
+    }
+    listed_cv_.notify_all();
+  }
+
+  template <class Emit>
+  void emit_node(Node &n, Emit &emit) {
+    int expected = kPending;
+    if (n.state.compare_exchange_strong(expected, kRunning)) {
+      list(n, deques_.size() - 1);
+    } else {
+      std::unique_lock<std::mutex> lk(m_);
+      listed_cv_.wait(lk, [&] { return n.state.load() == kListed; });
+    }
+    if (n.level > 0) {
+      {
+        std::lock_guard<std::mutex> lk(m_);
+        --held_;
+      }
+      work_cv_.notify_all();
+    }
+    for (Item &it : n.items) {
+      if (it.child) {
+        emit_node(*it.child, emit);
+        it.child.reset();
+      } else {
+        emit(static_cast<const fs::path &>(it.dir), static_cast<const fs::path &>(it.first_file), it.shallow);
+      }
+    }
+    n.items.clear();
+  }
+
+  const std::size_t cap_;
+  std::vector<std::unique_ptr<Deque>> deques_;
+  std::vector<std::thread> workers_;
+  std::mutex m_;
+  std::condition_variable work_cv_, listed_cv_;
+  std::atomic<std::size_t> queued_{0};
+  std::size_t held_ = 0;
+  bool stop_ = false;
+};
+
+static const std::vector<fs::path> &roots_for_type(const Config &cfg, MediaType media) {
+  switch (media) {
+    case MediaType::Mp3: return cfg.mp3_dirs.empty() ? cfg.music_dirs : cfg.mp3_dirs;
+    case MediaType::Flac: break;
+  }
+  return cfg.flac_dirs.empty() ? cfg.music_dirs : cfg.flac_dirs;
+}
+
+static TypeRun make_type_run(const MediaTypeInfo &media, const Config &cfg, CategoryMask indexes,
+                             const RunOptions &opt) {
+  TypeRun run;
+  run.type = media.name;
+  run.ext = media.ext;
+  run.release_depth = media.media == MediaType::Mp3 ? cfg.mp3_release_depth : cfg.flac_release_depth;
+  run.roots = roots_for_type(cfg, media.media);
+  run.indexes = indexes;
+  run.state_path = state_file_path(cfg, run.type);
+  // A shard writes no links; fan-out is decided where the partials are merged.
+  run.fanout.configure(cfg.shard.empty() ? cfg.fanout_threshold : 0, cfg.fanout_hash);
+  if (cfg.incremental && !opt.full_rescan) {
+    std::error_code ec;
+    run.prev_state_loaded = fs::exists(run.state_path, ec);
+    run.prev_state = load_state(run.state_path, run.prev_releases);
+  }
+  return run;
+}
+
+// The category directories this type writes.
+static std::vector<std::string> type_categories(const TypeRun &run) {
+  std::vector<std::string> cats;
+  for (std::size_t c = 0; c < kNumCategories; ++c) {
+    if (run.indexes & category_bit(static_cast<Category>(c))) cats.push_back(kCategoryDirs[c]);
+  }
+  return cats;
+}
+
+// Clean only the categories this type will touch.
+static void clean_type(const TypeRun &run, const Config &cfg, const RunOptions &opt) {
+  fs::path type_root = cfg.index_root / run.type;
+  for (const auto &cat : type_categories(run)) {
+    clean_index_tree(category_dir(type_root, cat, false), opt.dry_run);
+  }
+}
+
+// ---- checkpoints ----
+//
+// A run that dies part-way (OOM, a reboot, an NFS outage) can be continued with
+// --resume instead of starting again from the first root. Every CHECKPOINT_SECS
+// the scan stops at the next top-level directory of its root (a date directory
+// at depth 2, a release at depth 1), waits until everything before it is linked
+// and records the finished roots and top-level directories plus every type's
+// seen releases in <state dir>/scan.checkpoint; the releases indexed so far go to
+// <type>.checkpoint in the state file format (also with INCREMENTAL=false, which
+// only skips the state file). A completed run removes them. Runs
+// that don't link while scanning (--reconcile, --rebuild, --dry-run) take none.
+
+static const char *const kCheckpointHeader = "mp3flac-indexer-checkpoint 1";
+
+class Checkpoint {
+ public:
+  Checkpoint(const Config &cfg, std::vector<TypeRun> &runs, const RunOptions &opt)
+      : runs_(runs),
+        dir_(cfg.index_root / ".mp3flac-state"),
+        interval_(std::chrono::seconds(cfg.checkpoint_secs)),
+        enabled_(cfg.checkpoint_secs > 0 && !opt.dry_run && !opt.reconcile && !(opt.clean && opt.atomic_rebuild) &&
+                 cfg.link_manifest.empty()) {}
+
+  bool enabled() const { return enabled_; }
+
+  bool exists() const {
+    std::error_code ec;
+    return fs::exists(path(), ec);
+  }
+
+  // Restore the finished part of an interrupted run: its state entries, indexed
+  // releases and seen release directories. False if there is no checkpoint.
+  bool load() {
+    std::ifstream in(path());
+    if (!in) return false;
+    std::string line;
+    if (!std::getline(in, line) || line != kCheckpointHeader) {
+      std::cerr << "[warn] ignoring checkpoint with unknown format: " << path() << "\n";
+      return false;
+    }
+    while (std::getline(in, line)) {
+      auto f = split_tabs(line);
+      if (f[0] == "D" && f.size() >= 3) {
+        resumed_.insert(line.substr(2));
+      } else if (f[0] == "S" && f.size() == 3) {
+        for (TypeRun &run : runs_) {
+          if (run.type == f[1]) run.seen_release_dirs.insert(g_release_keys.intern(state_unescape(f[2])));
+        }
+      }
+    }
+    for (TypeRun &run : runs_) {
+      ScanState restored = load_state(type_path(run.type), run.releases);
+      for (auto &[key, e] : restored) {
+        if (run.keep_indexed) run.indexed[key] = e.release;
+        run.next_state[key] = std::move(e);
+      }
+      run.releases_indexed += restored.size();
+      g_status.add(Counter::Indexed, restored.size());
+      std::cerr << "[resume] [" << run.type << "] " << restored.size() << " releases from checkpoint\n";
+    }
+    done_ = resumed_;
+    return true;
+  }
+
+  bool due() const { return enabled_ && std::chrono::steady_clock::now() - last_ >= interval_; }
+
+  // Top-level directory `unit` of the group's root / the whole group was finished
+  // by the interrupted run. Only reads what load() restored, so walker threads
+  // may call it.
+  bool done(const ScanGroup &g, const std::string &unit) const { return resumed_.count(key(g, &unit)) > 0; }
+  bool done(const ScanGroup &g) const { return resumed_.count(key(g, nullptr)) > 0; }
+  void finish(const ScanGroup &g, const std::string &unit) {
+    if (enabled_) done_.insert(key(g, &unit));
+  }
+  void finish(const ScanGroup &g) {
+    if (enabled_) done_.insert(key(g, nullptr));
+  }
+
+  // Everything finished so far must be linked (pool and link writer drained).
+  void write() {
+    last_ = std::chrono::steady_clock::now();
+    for (const TypeRun &run : runs_) save_state(type_path(run.type), run.next_state, run.releases, false);
+
+    // Same write-then-rename as the state file; scan.checkpoint goes last.
+    fs::path tmp = path();
+    tmp += ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::trunc);
+      if (!out) throw std::runtime_error("Cannot write checkpoint: " + tmp.string());
+      out << kCheckpointHeader << "\n";
+      for (const std::string &k : done_) out << "D\t" << k << '\n';
+      for (const TypeRun &run : runs_) {
+        for (std::string_view k : run.seen_release_dirs) {
+          out << "S\t" << run.type << '\t' << state_escape(std::string(k)) << '\n';
+        }
+      }
+      if (!out) throw std::runtime_error("Cannot write checkpoint: " + tmp.string());
+    }
+    std::error_code ec;
+    fs::rename(tmp, path(), ec);
+    if (ec) throw std::runtime_error("Cannot replace checkpoint: " + path().string() + " (" + ec.message() + ")");
+  }
+
+  void remove() {
+    std::error_code ec;
+    fs::remove(path(), ec);
+    for (const TypeRun &run : runs_) fs::remove(type_path(run.type), ec);
+  }
+
+ private:
+  fs::path path() const { return dir_ / "scan.checkpoint"; }
+  fs::path type_path(const std::string &type) const { return dir_ / (type + ".checkpoint"); }
+
+  static std::string key(const ScanGroup &g, const std::string *unit) {
+    std::string k = state_escape(g.root.string()) + '\t' + std::to_string(g.release_depth);
+    if (unit) k += '\t' + state_escape(*unit);
+    return k;
+  }
+
+  std::vector<TypeRun> &runs_;
+  fs::path dir_;
+  std::chrono::steady_clock::duration interval_;
+  bool enabled_;
+  std::chrono::steady_clock::time_point last_ = std::chrono::steady_clock::now();
+  std::unordered_set<std::string> resumed_;
+  std::unordered_set<std::string> done_;
+};
+
+// ---- scan window ----
+//
+// SCAN_WINDOW_DAYS=N (today and the N-1 days before) or --since DATE: in roots
+// with a release depth of 2 or more, a top-level directory is skipped when the
+// date its name starts with (YYYY-MM-DD or YYYYMMDD; a name without one counts
+// as old) and its mtime both lie before the window. A release moved into an
+// old date directory updates that directory's mtime, so it is still found. Releases the
+// incremental state has under skipped directories are kept as they are: their
+// links are left alone and they stay in the state file, the catalog and
+// reconcile's wanted links.
+
+struct ScanWindow {
+  bool active = false;
+  std::int64_t first_day = 0;  // days since 1970-01-01
+  std::int64_t first_ns = 0;   // local midnight at the start of first_day
+
+  bool outside(const fs::path &dir) const {
+    std::optional<std::int64_t> day = parse_date_prefix(dir.filename().native());
+    if (day && *day >= first_day) return false;
+    struct stat st {};
+    if (::stat(dir.c_str(), &st) != 0) return false;  // can't tell, walk it
+    return stat_mtime_ns(st) < first_ns;
+  }
+
+  // "2024-05-01..." or "20240501...", as days since the epoch.
+  static std::optional<std::int64_t> parse_date_prefix(std::string_view name) {
+    auto num = [&](std::size_t pos, std::size_t len, int &out) {
+      if (name.size() < pos + len) return false;
+      out = 0;
+      for (std::size_t i = pos; i < pos + len; ++i) {
+        if (!std::isdigit(static_cast<unsigned char>(name[i]))) return false;
+        out = out * 10 + (name[i] - '0');
+      }
+      return true;
+    };
+    int y = 0, m = 0, d = 0;
+    const bool dashed = name.size() >= 10 && name[4] == '-' && name[7] == '-';
+    if (!(dashed ? num(0, 4, y) && num(5, 2, m) && num(8, 2, d) : num(0, 4, y) && num(4, 2, m) && num(6, 2, d))) {
+      return std::nullopt;
+    }
+    const std::chrono::year_month_day ymd{std::chrono::year{y}, std::chrono::month{static_cast<unsigned>(m)},
+                                          std::chrono::day{static_cast<unsigned>(d)}};
+    if (!ymd.ok()) return std::nullopt;
+    return std::chrono::sys_days(ymd).time_since_epoch().count();
+  }
+};
+
+static ScanWindow make_scan_window(const RunOptions &opt) {
+  ScanWindow w;
+  if (opt.window_days <= 0 && opt.since.empty()) return w;
+  if (opt.clean || opt.full_rescan) {
+    std::cerr << "[warn] scan window ignored: --clean/--rebuild/--full walk everything\n";
+    return w;
+  }
+  if (!opt.since.empty()) {
+    std::optional<std::int64_t> day = ScanWindow::parse_date_prefix(opt.since);
+    if (!day || opt.since.size() != 10) throw std::runtime_error("--since needs YYYY-MM-DD: " + opt.since);
+    w.first_day = *day;
+  } else {
+    std::time_t now = std::time(nullptr);
+    std::tm lt {};
+    ::localtime_r(&now, &lt);
+    const std::chrono::year_month_day today{std::chrono::year{lt.tm_year + 1900},
+                                            std::chrono::month{static_cast<unsigned>(lt.tm_mon + 1)},
+                                            std::chrono::day{static_cast<unsigned>(lt.tm_mday)}};
+    w.first_day = std::chrono::sys_days(today).time_since_epoch().count() - (opt.window_days - 1);
+  }
+  const std::chrono::year_month_day first{std::chrono::sys_days(std::chrono::days(w.first_day))};
+  std::tm start {};
+  start.tm_year = static_cast<int>(first.year()) - 1900;
+  start.tm_mon = static_cast<int>(static_cast<unsigned>(first.month())) - 1;
+  start.tm_mday = static_cast<int>(static_cast<unsigned>(first.day()));
+  start.tm_isdst = -1;
+  w.first_ns = static_cast<std::int64_t>(std::mktime(&start)) * 1000000000LL;
+  w.active = true;
+  return w;
+}
+
+// Top-level directories of one group that the window skipped; filled from the
+// walker threads.
+struct WindowSkipped {
+  std::mutex m;
+  std::unordered_set<std::string, StringHash, std::equal_to<>> names;
+};
+
+// "root/", for splitting release keys into top-level directory and rest.
+static std::string root_dir_prefix(const fs::path &root) {
+  std::string prefix = root.native();
+  if (prefix.empty() || prefix.back() != '/') prefix += '/';
+  return prefix;
+}
+
+// Reconcile mode: add the links `info` should have to run.desired_links.
+static void want_release_links(TypeRun &run, const ReleaseInfo &info, const Config &cfg, const RunOptions &opt,
+                               IndexDirs &dirs) {
+  for_each_release_link(cfg.index_root / run.type, info, run.indexes, run.staged, &run.fanout, true,
+                        [&](const std::string &dir, const std::string &link, const fs::path &target) {
+    std::string tgt = dirs.link_target(target, dir, cfg.relative_symlinks).string();
+    // Same collision rule as index_release: first release wins unless --force.
+    if (opt.force) run.desired_links[link] = std::move(tgt);
+    else run.desired_links.emplace(link, std::move(tgt));
+  });
+}
+
+// Walk one root once and feed every type of the group.
+static void scan_group(ScanGroup &group,
+                       const Config &cfg,
+                       const RunOptions &opt,
+                       IndexDirs &dirs,
+                       LinkWriter &links,
+                       Checkpoint &ckpt,
+                       const ParallelWalker::Skip &skip,
+                       ParallelWalker::Root *listed) {
+  std::error_code ec;
+  if (!fs::exists(group.root, ec)) {
+    std::cerr << "[warn] scan root does not exist: " << group.root << "\n";
+    for (TypeRun *t : group.types) t->roots_complete = false;
+    return;
+  }
+
+  g_status.set_root(group.root);
+  fs::directory_options opts = fs::directory_options::skip_permission_denied;
+  if (cfg.follow_symlinks)
+    opts |= fs::directory_options::follow_directory_symlink;
+
+  std::vector<const std::string *> exts;
+  for (TypeRun *t : group.types) exts.push_back(&t->ext);
+  const std::size_t ntypes = group.types.size();
+
+  // Results come back in walk order, so symlinks are created exactly as a serial
+  // run would create them (first release wins on name collisions).
+  auto apply = [&](ReleaseResult r) {
+    g_status.add(Counter::Delivered);
+    for (std::size_t i = 0; i < ntypes; ++i) {
+      TypeRun &run = *group.types[i];
+      TypeResult &t = r.types[i];
+      run.files_seen += t.files_seen;
+      if (!t.info) continue;
+      const ReleaseId row = run.releases.add(*t.info);
+      // Entries that could not be stat'ed are left out and simply re-read next time.
+      if (!t.entry.audio_file.empty()) {
+        t.entry.release = row;
+        run.next_state[std::string(r.release_key)] = std::move(t.entry);
+      }
+      if (run.keep_indexed && !r.release_key.empty()) run.indexed[std::string(r.release_key)] = row;
+      if (opt.reconcile) {
+        want_release_links(run, *t.info, cfg, opt, dirs);
+      } else if (cfg.shard.empty()) {
+        index_release(run.type, *t.info, cfg, run.indexes, opt.force, opt.dry_run, links, run.staged, &run.fanout);
+      }
+      ++run.releases_indexed;
+      g_status.add(Counter::Indexed);
+      if (t.from_state) ++run.releases_from_state;
+    }
+  };
+
+  OrderedPool<ReleaseJob, ReleaseResult> pool(
+      cfg.threads, static_cast<std::size_t>(cfg.threads) * 4,
+      [&](const ReleaseJob &job) {
+        const auto start = std::chrono::steady_clock::now();
+        ReleaseResult r = read_release_job(job, exts, opts, cfg);
+        g_status.read_time(std::chrono::steady_clock::now() - start, job.release_dir);
+        g_status.add(Counter::Read);
+        return r;
+      });
+
+  // With prefetching, jobs (and ready results, to keep their order) wait in `held`
+  // until PREFETCH_DISTANCE newer ones are queued behind them.
+  Prefetcher prefetch(g_io.rate_limited() ? 0 : cfg.prefetch_distance, cfg.prefetch_kb * 1024, cfg.tag_samples,
+                      exts, opts);
+  struct Held {
+    ReleaseJob job;
+    bool ready;
+  };
+  std::deque<Held> held;
+  std::size_t held_seq = 0, handed_seq = 0;
+  auto to_pool = [&](ReleaseJob job, bool ready) {
+    if (ready) {
+      g_status.add(Counter::QueuedReady);
+      pool.submit_ready(std::move(job.seed), apply);
+    } else {
+      g_status.add(Counter::Queued);
+      pool.submit(std::move(job), apply);
+    }
+  };
+  auto hand_over = [&](std::size_t keep) {
+    while (held.size() > keep) {
+      Held &h = held.front();
+      to_pool(std::move(h.job), h.ready);
+      held.pop_front();
+      prefetch.handed_over(++handed_seq);
+    }
+  };
+  auto submit = [&](ReleaseJob job, bool ready) {
+    g_status.add(Counter::Checked);
+    if (!prefetch.enabled()) {
+      to_pool(std::move(job), ready);
+      return;
+    }
+    if (!ready) prefetch.add(held_seq, job.release_dir, job.audio_file, job.shallow, job.want);
+    ++held_seq;
+    held.push_back(Held{std::move(job), ready});
+    hand_over(prefetch.distance());
+  };
+
+  // Releases are handled in batches so the incremental check's stats (release
+  // directory + recorded audio file per type) can be issued together.
+  struct Found {
+    fs::path release_dir;
+    fs::path first_file;
+    bool shallow;
+    std::string_view release_key;
+    bool key_ok;
+  };
+  constexpr std::size_t kStatBatch = 64;
+  std::vector<Found> batch;
+  batch.reserve(kStatBatch);
+  StatBatch stats;
+  std::vector<StatRequest> reqs;
+
+  auto process = [&](Found &f, const std::optional<FileIdentity> &dir_id, const StatRequest *file_ids) {
+    if (!f.key_ok) {
+      // No usable key: read it, but it can't be deduplicated or tracked.
+      submit(ReleaseJob{f.release_dir, f.first_file, f.shallow, false, std::vector<bool>(ntypes, true), {}}, false);
+      return;
+    }
+
+    // Checkpoints restore finished units from state entries, so they are recorded
+    // without INCREMENTAL too (next_state is then only saved to <type>.checkpoint).
+    ReleaseJob job{f.release_dir, f.first_file, f.shallow, cfg.incremental || ckpt.enabled(),
+                   std::vector<bool>(ntypes, false), {}};
+    job.seed.release_key = f.release_key;
+    job.seed.types.resize(ntypes);
+    bool any_current = false;
+    for (std::size_t i = 0; i < ntypes; ++i) {
+      TypeRun &run = *group.types[i];
+      // Overlapping roots or followed symlinks can reach a release twice.
+      if (!run.seen_release_dirs.insert(f.release_key).second) continue;
+
+      auto prev = cfg.incremental ? run.prev_state.find(f.release_key) : run.prev_state.end();
+      // Entries recorded before the audio-property indexes were enabled lack their values.
+      if (prev != run.prev_state.end() && state_entry_matches(prev->second, dir_id, file_ids[i].result) &&
+          !(cfg.audio_props && run.prev_releases.value(ReleaseTable::Bitrate, prev->second.release).empty())) {
+        TypeResult &t = job.seed.types[i];
+        t.info = run.prev_releases.get(prev->second.release);
+        t.entry = std::move(prev->second);
+        t.from_state = true;
+        any_current = true;
+        if (g_tags.enabled() && t.info) touch_tag_cache(*file_ids[i].result, *t.info, cfg);
+      } else {
+        job.want[i] = true;
+      }
+    }
+    // In a shared root, an unchanged release that had no files of some type last
+    // time (no entry in that type's state) is not searched for them again.
+    if (any_current) {
+      for (std::size_t i = 0; i < ntypes; ++i) {
+        if (job.want[i] && group.types[i]->prev_state_loaded &&
+            !group.types[i]->prev_state.count(f.release_key)) {
+          job.want[i] = false;
+        }
+      }
+    }
+
+    const bool ready = std::none_of(job.want.begin(), job.want.end(), [](bool w) { return w; });
+    submit(std::move(job), ready);
+  };
+
+  // Per release: one request for the directory, then one per type (path unset
+  // when the type has no state entry for it).
+  auto flush = [&] {
+    const std::size_t stride = ntypes + 1;
+    reqs.assign(batch.size() * stride, StatRequest{});
+    std::vector<StatRequest> wanted;
+    for (std::size_t b = 0; b < batch.size(); ++b) {
+      if (!cfg.incremental || !batch[b].key_ok) continue;
+      for (std::size_t i = 0; i < ntypes; ++i) {
+        auto prev = group.types[i]->prev_state.find(batch[b].release_key);
+        if (prev == group.types[i]->prev_state.end()) continue;
+        reqs[b * stride].path = &batch[b].release_dir;
+        reqs[b * stride + 1 + i].path = &prev->second.audio_file;
+      }
+    }
+    for (const StatRequest &r : reqs) {
+      if (r.path) wanted.push_back(r);
+    }
+    stats.run(wanted);
+    for (std::size_t r = 0, w = 0; r < reqs.size(); ++r) {
+      if (reqs[r].path) reqs[r].result = std::move(wanted[w++].result);
+    }
+    for (std::size_t b = 0; b < batch.size(); ++b) {
+      process(batch[b], reqs[b * stride].result, &reqs[b * stride + 1]);
+    }
+    batch.clear();
+  };
+
+  // Checkpoints are taken between top-level directories of the root, once all
+  // releases before the new one are applied and linked.
+  const std::string root_prefix = root_dir_prefix(group.root);
+  std::string unit;
+  bool in_unit = false;
+  auto enter_unit = [&](const fs::path &release_dir) {
+    std::string_view rel = release_dir.native();
+    rel = rel.size() > root_prefix.size() ? rel.substr(root_prefix.size()) : std::string_view{};
+    rel = rel.substr(0, rel.find('/'));
+    if (in_unit && rel == unit) return;
+    if (in_unit) ckpt.finish(group, unit);
+    unit.assign(rel);
+    in_unit = true;
+    if (!ckpt.due()) return;
+    flush();
+    hand_over(0);
+    pool.drain(apply);
+    links.drain();
+    ckpt.write();
+  };
+
+  // Walk time per release: from the previous emit returning to this one, so the
+  // submitting/indexing done inside the callback isn't counted as walking.
+  auto walk_mark = std::chrono::steady_clock::now();
+  auto on_release = [&](const fs::path &release_dir, const fs::path &first_file, bool shallow) {
+    g_metrics.stage(Stage::Walk).record(std::chrono::steady_clock::now() - walk_mark);
+    g_status.add(Counter::Found);
+    struct MarkOnExit {
+      std::chrono::steady_clock::time_point &mark;
+      ~MarkOnExit() { mark = std::chrono::steady_clock::now(); }
+    } mark_on_exit{walk_mark};
+    if (ckpt.enabled()) enter_unit(release_dir);
+
+    // Scan roots are absolute, so release_dir normally is too.
+    std::error_code kec;
+    std::string_view release_key = release_dir.is_absolute()
+                                       ? g_release_keys.intern(release_dir.native())
+                                       : g_release_keys.intern(fs::absolute(release_dir, kec).native());
+    batch.push_back(Found{release_dir, first_file, shallow, release_key, !kec});
+    if (batch.size() >= kStatBatch) flush();
+  };
+  if (listed) {
+    listed->walk(on_release);
+  } else {
+    walk_releases(group.root, 0, group.release_depth, exts, cfg.follow_symlinks, on_release, skip);
+  }
+  flush();
+  hand_over(0);
+  pool.drain(apply);
+}
+
+// Keep the releases the state has under top-level directories the scan window
+// skipped, as if they had been found unchanged (their links are not rewritten).
+static void keep_outside_window(ScanGroup &group,
+                                const WindowSkipped &skipped,
+                                const Config &cfg,
+                                const RunOptions &opt,
+                                IndexDirs &dirs) {
+  if (skipped.names.empty()) return;
+  const std::string prefix = root_dir_prefix(group.root);
+  for (TypeRun *t : group.types) {
+    TypeRun &run = *t;
+    if (!run.prev_state_loaded) {
+      // Nothing recorded about them: reconcile must not treat their links as stale.
+      run.roots_complete = false;
+      continue;
+    }
+    for (const auto &[key, e] : run.prev_state) {
+      if (key.size() <= prefix.size() || key.compare(0, prefix.size(), prefix) != 0) continue;
+      std::string_view rest = std::string_view(key).substr(prefix.size());
+      if (!skipped.names.count(rest.substr(0, rest.find('/')))) continue;
+      if (!run.seen_release_dirs.insert(g_release_keys.intern(key)).second) continue;
+      const ReleaseInfo info = run.prev_releases.get(e.release);
+      StateEntry kept = e;
+      kept.release = run.releases.add(info);
+      if (run.keep_indexed) run.indexed[key] = kept.release;
+      run.next_state[key] = std::move(kept);
+      if (opt.reconcile) want_release_links(run, info, cfg, opt, dirs);
+      ++run.releases_indexed;
+      g_status.add(Counter::Indexed);
+      ++run.releases_outside_window;
+    }
+  }
+}
+
+// Group the types' roots so each distinct (root, release depth) is walked once,
+// e.g. a MUSIC_DIR shared by mp3 and flac. Groups keep the order in which the
+// roots first appear (mp3 roots, then flac-only roots).
+static std::vector<ScanGroup> make_scan_groups(std::vector<TypeRun> &runs) {
+  std::vector<ScanGroup> groups;
+  for (TypeRun &run : runs) {
+    for (const auto &root : run.roots) {
+      std::error_code ec;
+      fs::path key = fs::absolute(root, ec).lexically_normal();
+      if (ec) key = root;
+      auto it = std::find_if(groups.begin(), groups.end(), [&](const ScanGroup &g) {
+        return g.root == key && g.release_depth == run.release_depth &&
+               std::find(g.types.begin(), g.types.end(), &run) == g.types.end();
+      });
+      if (it == groups.end()) groups.push_back(ScanGroup{key, run.release_depth, {&run}});
+      else it->types.push_back(&run);
+    }
+  }
+  return groups;
+}
+
+// ---- metrics export ----
+
+static std::string json_escape(const std::string &s) {
+  std::string out;
+  for (char ch : s) {
+    unsigned char c = static_cast<unsigned char>(ch);
+    if (ch == '"' || ch == '\\') {
+      out.push_back('\\');
+      out.push_back(ch);
+    } else if (c < 0x20) {
+      char buf[8];
+      std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out.push_back(ch);
+    }
+  }
+  return out;
+}
+
+// Write `content` to `path` through a temp file + rename, so collectors never
+// read a half-written file.
+static void write_file_atomic(const fs::path &path, const std::string &content) {
+  std::error_code ec;
+  if (path.has_parent_path()) fs::create_directories(path.parent_path(), ec);
+  fs::path tmp = path;
+  tmp += ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    out << content;
+    if (!out) throw std::runtime_error("Cannot write file: " + tmp.string());
+  }
+  fs::rename(tmp, path, ec);
+  if (ec) throw std::runtime_error("Cannot replace file: " + path.string() + " (" + ec.message() + ")");
+}
+
+static std::string metrics_json(const std::vector<TypeRun> &runs, double run_seconds) {
+  std::ostringstream o;
+  o << "{\n  \"run_seconds\": " << run_seconds << ",\n  \"stages\": {";
+  for (std::size_t i = 0; i < static_cast<std::size_t>(Stage::Count); ++i) {
+    const StageMetrics &m = g_metrics.stages[i];
+    o << (i ? "," : "") << "\n    \"" << kStageNames[i] << "\": {\"calls\": " << m.calls.load()
+      << ", \"seconds\": " << static_cast<double>(m.total_ns.load()) / 1e9 << ", \"buckets\": [";
+    for (std::size_t b = 0; b < kNumBuckets; ++b) {
+      o << (b ? ", " : "") << "{\"le\": ";
+      if (b + 1 < kNumBuckets) o << kLatencyBuckets[b];
+      else o << "\"+Inf\"";
+      o << ", \"count\": " << m.buckets[b].load() << "}";
+    }
+    o << "]}";
+  }
+  o << "\n  },\n  \"counters\": {"
+    << "\n    \"tag_parse_failures\": " << g_metrics.tag_parse_failures.load() << ","
+    << "\n    \"tag_fast_path\": " << g_metrics.tag_fast_path.load() << ","
+    << "\n    \"tag_taglib\": " << g_metrics.tag_taglib.load() << ","
+    << "\n    \"tag_cache_hits\": " << g_metrics.tag_cache_hits.load() << ","
+    << "\n    \"symlinks_created\": " << g_metrics.symlinks_created.load() << ","
+    << "\n    \"symlinks_kept\": " << g_metrics.symlinks_kept.load() << ","
+    << "\n    \"symlink_errors\": " << g_metrics.symlink_errors.load() << ","
+    << "\n    \"tag_read_bytes\": " << g_metrics.tag_read_bytes.load() << ","
+    << "\n    \"io_throttle_seconds\": " << static_cast<double>(g_metrics.io_throttle_ns.load()) / 1e9
+    << "\n  },\n  \"types\": {";
+  for (std::size_t i = 0; i < runs.size(); ++i) {
+    const TypeRun &r = runs[i];
+    o << (i ? "," : "") << "\n    \"" << json_escape(r.type) << "\": {\"files_seen\": " << r.files_seen
+      << ", \"releases_indexed\": " << r.releases_indexed << ", \"releases_from_state\": " << r.releases_from_state
+      << "}";
+  }
+  o << "\n  }\n}\n";
+  return o.str();
+}
+
+// Prometheus text exposition format, for node_exporter's textfile collector.
+static std::string metrics_prometheus(const std::vector<TypeRun> &runs, double run_seconds) {
+  std::ostringstream o;
+  o << "# HELP mp3flac_run_duration_seconds Wall time of the last run.\n"
+    << "# TYPE mp3flac_run_duration_seconds gauge\n"
+    << "mp3flac_run_duration_seconds " << run_seconds << "\n"
+    << "# HELP mp3flac_last_run_timestamp_seconds Unix time the last run finished.\n"
+    << "# TYPE mp3flac_last_run_timestamp_seconds gauge\n"
+    << "mp3flac_last_run_timestamp_seconds "
+    << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+    << "\n"
+    << "# HELP mp3flac_stage_duration_seconds Per-call latency of each pipeline stage.\n"
+    << "# TYPE mp3flac_stage_duration_seconds histogram\n";
+  for (std::size_t i = 0; i < static_cast<std::size_t>(Stage::Count); ++i) {
+    const StageMetrics &m = g_metrics.stages[i];
+    std::uint64_t cum = 0;
+    for (std::size_t b = 0; b < kNumBuckets; ++b) {
+      cum += m.buckets[b].load();
+      o << "mp3flac_stage_duration_seconds_bucket{stage=\"" << kStageNames[i] << "\",le=\"";
+      if (b + 1 < kNumBuckets) o << kLatencyBuckets[b];
+      else o << "+Inf";
+      o << "\"} " << cum << "\n";
+    }
+    o << "mp3flac_stage_duration_seconds_sum{stage=\"" << kStageNames[i] << "\"} "
+      << static_cast<double>(m.total_ns.load()) / 1e9 << "\n"
+      << "mp3flac_stage_duration_seconds_count{stage=\"" << kStageNames[i] << "\"} " << m.calls.load() << "\n";
+  }
+  auto counter = [&](const char *name, const char *help, std::uint64_t v) {
+    o << "# HELP mp3flac_" << name << " " << help << "\n# TYPE mp3flac_" << name << " counter\nmp3flac_" << name
+      << " " << v << "\n";
+  };
+  counter("tag_parse_failures_total", "Audio files whose tags could not be read.", g_metrics.tag_parse_failures.load());
+  counter("tag_fast_path_total", "Tag reads served by the built-in ID3v2/FLAC reader.", g_metrics.tag_fast_path.load());
+  counter("tag_taglib_total", "Tag reads that went through TagLib.", g_metrics.tag_taglib.load());
+  counter("tag_cache_hits_total", "Tag reads answered from the tag cache.", g_metrics.tag_cache_hits.load());
+  counter("symlinks_created_total", "Index symlinks created or replaced.", g_metrics.symlinks_created.load());
+  counter("symlinks_kept_total", "Index symlinks left alone because they existed.", g_metrics.symlinks_kept.load());
+  counter("symlink_errors_total", "Failed symlink operations.", g_metrics.symlink_errors.load());
+  counter("tag_read_bytes_total", "Approximate bytes read for tags.", g_metrics.tag_read_bytes.load());
+  o << "# HELP mp3flac_io_throttle_seconds_total Time tag readers waited on the I/O governor.\n"
+    << "# TYPE mp3flac_io_throttle_seconds_total counter\n"
+    << "mp3flac_io_throttle_seconds_total " << static_cast<double>(g_metrics.io_throttle_ns.load()) / 1e9 << "\n";
+
+  o << "# HELP mp3flac_releases_indexed Releases indexed in the last run.\n"
+    << "# TYPE mp3flac_releases_indexed gauge\n";
+  for (const TypeRun &r : runs) o << "mp3flac_releases_indexed{type=\"" << r.type << "\"} " << r.releases_indexed << "\n";
+  o << "# HELP mp3flac_files_seen Audio files looked at in the last run.\n"
+    << "# TYPE mp3flac_files_seen gauge\n";
+  for (const TypeRun &r : runs) o << "mp3flac_files_seen{type=\"" << r.type << "\"} " << r.files_seen << "\n";
+  return o.str();
+}
+
+static void write_metrics(const Config &cfg, const std::vector<TypeRun> &runs, double run_seconds) {
+  try {
+    if (!cfg.metrics_json.empty()) write_file_atomic(cfg.metrics_json, metrics_json(runs, run_seconds));
+    if (!cfg.metrics_prom.empty()) write_file_atomic(cfg.metrics_prom, metrics_prometheus(runs, run_seconds));
+  } catch (const std::exception &e) {
+    // Metrics must never fail the run itself.
+    std::cerr << "[warn] " << e.what() << "\n";
+  }
+}
+
+// ---- status report ----
+//
+// With STATUS_JSON=/path a thread rewrites that file every STATUS_SECS from the
+// Status counters: phase, current root, releases done and per second (last 10 s),
+// the ETA against the previous run's release count, the depth of each pipeline
+// queue and the slowest release reads. Written once more when the process ends.
+// The release count comes from the loaded state or, without one (INCREMENTAL=false,
+// --full), from .mp3flac-state/<type>.count, which every finished run rewrites.
+
+static fs::path release_count_path(const Config &cfg, const std::string &type) {
+  return cfg.index_root / ".mp3flac-state" / (type + ".count");
+}
+
+static std::uint64_t load_release_count(const Config &cfg, const TypeRun &run) {
+  if (run.prev_state_loaded) return run.prev_state.size();
+  std::ifstream in(release_count_path(cfg, run.type));
+  std::uint64_t n = 0;
+  return (in >> n) ? n : 0;
+}
+
+static void save_release_count(const Config &cfg, const TypeRun &run, bool dry_run) {
+  if (dry_run) return;
+  try {
+    write_file_atomic(release_count_path(cfg, run.type), std::to_string(run.releases.size()) + "\n");
+  } catch (const std::exception &e) {
+    // Like the metrics, only the ETA depends on it.
+    std::cerr << "[warn] " << e.what() << "\n";
+  }
+}
+
+class StatusReporter {
+ public:
+  static constexpr double kRateWindow = 10.0;
+
+  explicit StatusReporter(const Config &cfg)
+      : path_(cfg.status_json), period_(std::chrono::seconds(std::max(cfg.status_secs, 1))) {
+    if (path_.empty()) return;
+    g_status.enable();
+    start();
+  }
+
+  StatusReporter(const StatusReporter &) = delete;
+  StatusReporter &operator=(const StatusReporter &) = delete;
+
+  ~StatusReporter() {
+    if (path_.empty()) return;
+    stop();
+    g_status.set_phase("exited");
+    write();
+  }
+
+  // The reporter thread is joined around fork() (see remove_in_background).
+  void start() {
+    if (path_.empty() || thread_.joinable()) return;
+    stop_ = false;
+    thread_ = std::thread([this] { loop(); });
+  }
+
+  void stop() {
+    if (!thread_.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+ private:
+  void loop() {
+    std::unique_lock<std::mutex> lk(m_);
+    while (!stop_) {
+      lk.unlock();
+      write();
+      lk.lock();
+      cv_.wait_for(lk, period_, [&] { return stop_; });
+    }
+  }
+
+  void write() {
+    using Clock = std::chrono::steady_clock;
+    const auto now = Clock::now();
+    const Status::Totals t = g_status.totals();
+    const Status::Run run = g_status.run();
+    auto n = [&](Counter c) { return t[static_cast<std::size_t>(c)]; };
+    // Counters of different threads are read at slightly different times.
+    auto depth = [](std::uint64_t in, std::uint64_t out) { return in > out ? in - out : 0; };
+
+    const std::uint64_t indexed = n(Counter::Indexed);
+    const std::uint64_t done = depth(indexed, run.indexed_base);
+    samples_.emplace_back(now, indexed);
+    while (samples_.size() > 2 &&
+           std::chrono::duration<double>(now - samples_[1].first).count() >= kRateWindow) {
+      samples_.pop_front();
+    }
+    const double span = std::chrono::duration<double>(now - samples_.front().first).count();
+    const double rate = span > 0 ? static_cast<double>(indexed - samples_.front().second) / span : 0.0;
+
+    std::ostringstream o;
+    o << "{\n  \"phase\": \"" << json_escape(run.phase) << "\",\n  \"root\": \"" << json_escape(run.root)
+      << "\",\n  \"pid\": " << ::getpid()
+      << ",\n  \"run_seconds\": " << std::chrono::duration<double>(now - run.start).count()
+      << ",\n  \"releases_done\": " << done << ",\n  \"releases_expected\": ";
+    if (run.expected) o << run.expected;
+    else o << "null";
+    o << ",\n  \"releases_per_second\": " << rate << ",\n  \"eta_seconds\": ";
+    if (run.phase == "scanning" && run.expected > done && rate > 0) {
+      o << static_cast<double>(run.expected - done) / rate;
+    } else {
+      o << "null";
+    }
+    o << ",\n  \"queues\": {"
+      << "\n    \"stat_batch\": " << depth(n(Counter::Found), n(Counter::Checked)) << ","
+      << "\n    \"prefetch\": " << depth(n(Counter::Checked), n(Counter::Queued) + n(Counter::QueuedReady)) << ","
+      << "\n    \"tag_read\": " << depth(n(Counter::Queued), n(Counter::Read)) << ","
+      << "\n    \"reorder\": " << depth(n(Counter::Read) + n(Counter::QueuedReady), n(Counter::Delivered)) << ","
+      << "\n    \"links\": " << depth(n(Counter::LinksQueued), n(Counter::LinksDone))
+      << "\n  },\n  \"slowest_reads\": [";
+    const std::vector<Status::SlowPath> slow = g_status.slowest();
+    for (std::size_t i = 0; i < slow.size(); ++i) {
+      o << (i ? "," : "") << "\n    {\"path\": \"" << json_escape(slow[i].second)
+        << "\", \"seconds\": " << static_cast<double>(slow[i].first) / 1e9 << "}";
+    }
+    o << (slow.empty() ? "]" : "\n  ]") << "\n}\n";
+    try {
+      write_file_atomic(path_, o.str());
+    } catch (const std::exception &e) {
+      // Like the metrics, the status file must never fail the run.
+      std::cerr << "[warn] " << e.what() << "\n";
+    }
+  }
+
+  fs::path path_;
+  std::chrono::seconds period_;
+  std::deque<std::pair<std::chrono::steady_clock::time_point, std::uint64_t>> samples_;
+  std::mutex m_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+// Set by main for the process's reporter, so run_scan can pause it.
+static StatusReporter *g_reporter = nullptr;
+
+// ---- catalog ----
+//
+// <INDEX_ROOT>/<type>.catalog (CATALOG=true): every indexed release of the type
+// in one file meant to be mmap'ed by other tools, e.g. to answer "2019 Techno
+// releases by group X" by intersecting three posting lists instead of listing
+// index directories. Integers are in the writer's byte order so the posting
+// lists can be used in place; the version field (1) doubles as the byte-order
+// mark, and a reader on a host of the other order sees 0x01000000 there.
+// Layout (all offsets from the start of the file):
+//
+//   CatalogHeader
+//   CatalogRelease[release_count]        sorted by release path (bytewise)
+//   CatalogValue[values of field 0..5]   per field, sorted by value (bytewise)
+//   u32 postings[]                       per value: ascending release indices
+//   char strings[]                       release paths and values, not terminated
+//
+// Fields are artist, album, genre, year, group, alpha (see CatalogField). A
+// release's field ids index into that field's value array.
+
+enum CatalogField : std::uint32_t { kCatArtist, kCatAlbum, kCatGenre, kCatYear, kCatGroup, kCatAlpha, kCatFields };
+
+static constexpr char kCatalogMagic[8] = {'M', 'P', '3', 'F', 'C', 'A', 'T', '1'};
+
+struct CatalogHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t release_count;
+  std::uint64_t releases_offset;
+  // Per field: first CatalogValue and number of values.
+  std::uint64_t values_offset[kCatFields];
+  std::uint32_t value_count[kCatFields];
+  std::uint64_t postings_offset;
+  std::uint64_t strings_offset;
+  std::uint64_t strings_size;
+};
+
+struct CatalogRelease {
+  std::uint64_t path_offset;  // into strings
+  std::uint32_t path_size;
+  std::uint32_t field[kCatFields];
+  std::uint32_t reserved;
+};
+
+struct CatalogValue {
+  std::uint64_t str_offset;  // into strings
+  std::uint32_t str_size;
+  std::uint32_t postings_count;
+  std::uint64_t postings_index;  // first u32 in postings[]
+};
+
+static_assert(sizeof(CatalogHeader) == 120 && sizeof(CatalogRelease) == 40 && sizeof(CatalogValue) == 24,
+              "catalog structs must not change layout");
+
+static fs::path catalog_path(const Config &cfg, const std::string &type) {
+  return cfg.index_root / (type + ".catalog");
+}
+
+template <class T>
+static void append_pod(std::string &out, const T &v) {
+  out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+// Build the catalog bytes for `rows` of `table`.
+static std::string build_catalog(const ReleaseTable &table, std::vector<ReleaseId> rows) {
+  std::sort(rows.begin(), rows.end(),
+            [&](ReleaseId a, ReleaseId b) { return table.release_dir(a) < table.release_dir(b); });
+
+  std::string strings;
+  auto add_string = [&](std::string_view s) {
+    std::uint64_t off = strings.size();
+    strings.append(s.data(), s.size());
+    return off;
+  };
+
+  std::vector<CatalogRelease> releases(rows.size());
+  for (std::size_t r = 0; r < rows.size(); ++r) {
+    std::string_view path = table.release_dir(rows[r]);
+    releases[r].path_offset = add_string(path);
+    releases[r].path_size = static_cast<std::uint32_t>(path.size());
+    releases[r].reserved = 0;
+  }
+
+  // Renumber each field's values in sorted order (table dictionary ids are in
+  // insertion order and may include values no listed release uses).
+  // Backing store for the one-letter alpha values.
+  std::array<char, 256> alpha_chars;
+  for (std::size_t i = 0; i < alpha_chars.size(); ++i) alpha_chars[i] = static_cast<char>(i);
+
+  std::vector<CatalogValue> values;
+  std::vector<std::uint32_t> postings;
+  std::uint32_t value_count[kCatFields] = {};
+  std::uint64_t value_first[kCatFields] = {};
+  for (std::uint32_t f = 0; f < kCatFields; ++f) {
+    std::unordered_map<std::string_view, std::vector<std::uint32_t>> by_value;
+    for (std::size_t r = 0; r < rows.size(); ++r) {
+      std::string_view v;
+      if (f == kCatAlpha) {
+        v = std::string_view(&alpha_chars[static_cast<unsigned char>(table.alpha(rows[r]))], 1);
+      } else {
+        v = table.value(static_cast<ReleaseTable::Field>(f), rows[r]);
+      }
+      by_value[v].push_back(static_cast<std::uint32_t>(r));
+    }
+    std::vector<std::string_view> sorted;
+    sorted.reserve(by_value.size());
+    for (const auto &kv : by_value) sorted.push_back(kv.first);
+    std::sort(sorted.begin(), sorted.end());
+
+    value_first[f] = values.size();
+    value_count[f] = static_cast<std::uint32_t>(sorted.size());
+    for (std::uint32_t id = 0; id < sorted.size(); ++id) {
+      const std::vector<std::uint32_t> &list = by_value[sorted[id]];
+      CatalogValue cv{};
+      cv.str_offset = add_string(sorted[id]);
+      cv.str_size = static_cast<std::uint32_t>(sorted[id].size());
+      cv.postings_count = static_cast<std::uint32_t>(list.size());
+      cv.postings_index = postings.size();
+      values.push_back(cv);
+      for (std::uint32_t r : list) releases[r].field[f] = id;
+      postings.insert(postings.end(), list.begin(), list.end());
+    }
+  }
+
+  CatalogHeader h{};
+  std::memcpy(h.magic, kCatalogMagic, sizeof(h.magic));
+  h.version = 1;
+  h.release_count = static_cast<std::uint32_t>(releases.size());
+  h.releases_offset = sizeof(CatalogHeader);
+  std::uint64_t values_offset = h.releases_offset + releases.size() * sizeof(CatalogRelease);
+  for (std::uint32_t f = 0; f < kCatFields; ++f) {
+    h.values_offset[f] = values_offset + value_first[f] * sizeof(CatalogValue);
+    h.value_count[f] = value_count[f];
+  }
+  h.postings_offset = values_offset + values.size() * sizeof(CatalogValue);
+  h.strings_offset = h.postings_offset + postings.size() * sizeof(std::uint32_t);
+  h.strings_size = strings.size();
+
+  std::string out;
+  out.reserve(h.strings_offset + strings.size());
+  append_pod(out, h);
+  for (const CatalogRelease &r : releases) append_pod(out, r);
+  for (const CatalogValue &v : values) append_pod(out, v);
+  out.append(reinterpret_cast<const char *>(postings.data()), postings.size() * sizeof(std::uint32_t));
+  out += strings;
+  return out;
+}
+
+// Watch mode lists the releases currently indexed; a plain run, all of this run's.
+static void write_catalog(const Config &cfg, const TypeRun &run, bool dry_run) {
+  if (!cfg.catalog || dry_run) return;
+  std::vector<ReleaseId> rows;
+  if (run.keep_indexed) {
+    rows.reserve(run.indexed.size());
+    for (const auto &kv : run.indexed) rows.push_back(kv.second);
+  } else {
+    rows.resize(run.releases.size());
+    for (std::size_t i = 0; i < rows.size(); ++i) rows[i] = static_cast<ReleaseId>(i);
+  }
+  write_file_atomic(catalog_path(cfg, run.type), build_catalog(run.releases, std::move(rows)));
+}
+
+// Make the type's category trees match run.desired_links (reconcile, merge).
+static void apply_desired_links(TypeRun &run, const Config &cfg, const RunOptions &opt, IndexDirs &dirs) {
+  std::vector<fs::path> cat_dirs;
+  for (const auto &cat : type_categories(run)) cat_dirs.push_back(category_dir(cfg.index_root / run.type, cat, run.staged));
+  const std::vector<std::string> fanned = fan_out_desired(run.desired_links, run.fanout);
+  ReconcileStats st = reconcile_links(cat_dirs, run.desired_links, run.roots_complete, opt.dry_run, dirs);
+  if (!opt.dry_run) {
+    for (const std::string &dir : fanned) {
+      dirs.ensure(dir, false);
+      write_fanout_marker(dir);
+    }
+  }
+  std::cerr << "[" << run.type << "] links added: " << st.added << ", retargeted: " << st.retargeted
+            << ", removed: " << st.removed << ", unchanged: " << st.unchanged << "\n";
+  run.desired_links.clear();
+}
+
+// ---- shards ----
+//
+// SHARD=<name> on a storage node scans its local roots and writes, instead of
+// links, one partial per type: the releases found, with their paths as the index
+// host sees them. `merge` on the index host reads the partials of all nodes and
+// reconciles the index against their union.
+
+static const char *const kPartialHeader = "mp3flac-indexer-partial 1";
+
+static fs::path partial_path(const Config &cfg, const std::string &type) {
+  return cfg.index_root / (type + "." + cfg.shard + ".partial");
+}
+
+// Rewrite `path` by the longest matching SHARD_PATH_MAP prefix (whole components).
+static std::string map_shard_path(const Config &cfg, const std::string &path) {
+  const std::pair<std::string, std::string> *best = nullptr;
+  for (const auto &m : cfg.shard_path_map) {
+    const std::string &local = m.first;
+    if (path.compare(0, local.size(), local) != 0 || (path.size() > local.size() && path[local.size()] != '/')) {
+      continue;
+    }
+    if (!best || local.size() > best->first.size()) best = &m;
+  }
+  return best ? best->second + path.substr(best->first.size()) : path;
+}
+
+// Header, "<type>\t<shard>", then one line per release: path and the tag fields
+// as in the state file.
+static void write_partial(const Config &cfg, const TypeRun &run, bool dry_run) {
+  if (dry_run) return;
+  std::string out = std::string(kPartialHeader) + "\n" + run.type + "\t" + cfg.shard + "\n";
+  for (std::size_t i = 0; i < run.releases.size(); ++i) {
+    const auto row = static_cast<ReleaseId>(i);
+    out += state_escape(map_shard_path(cfg, std::string(run.releases.release_dir(row))));
+    for (auto f : {ReleaseTable::Artist, ReleaseTable::Album, ReleaseTable::Genre, ReleaseTable::Year,
+                   ReleaseTable::Group}) {
+      out += '\t';
+      out += run.releases.value(f, row);
+    }
+    out += '\t';
+    out += run.releases.alpha(row);
+    for (auto f : {ReleaseTable::Bitrate, ReleaseTable::Format, ReleaseTable::Length}) {
+      out += '\t';
+      out += run.releases.value(f, row);
+    }
+    out += '\n';
+  }
+  write_file_atomic(partial_path(cfg, run.type), out);
+  std::cerr << "[" << run.type << "] partial with " << run.releases.size() << " releases written to "
+            << partial_path(cfg, run.type) << "\n";
+}
+
+struct Partial {
+  std::string type;
+  std::string shard;
+  std::vector<ReleaseInfo> releases;
+};
+
+static Partial load_partial(const fs::path &path) {
+  std::ifstream in(path);
+  if (!in) throw std::runtime_error("Cannot open partial: " + path.string());
+  std::string line;
+  if (!std::getline(in, line) || line != kPartialHeader || !std::getline(in, line)) {
+    throw std::runtime_error("Not a partial (SHARD output): " + path.string());
+  }
+  Partial p;
+  auto head = split_tabs(line);
+  if (head.size() != 2) throw std::runtime_error("Not a partial (SHARD output): " + path.string());
+  p.type = head[0];
+  p.shard = head[1];
+  while (std::getline(in, line)) {
+    auto f = split_tabs(line);
+    if (f.size() != 10 || f[0].empty()) continue;
+    ReleaseInfo info;
+    info.release_dir = state_unescape(f[0]);
+    info.release_name = info.release_dir.filename().string();
+    info.artist = f[1];
+    info.album = f[2];
+    info.genre = f[3];
+    info.year = f[4];
+    info.group = f[5];
+    info.alpha = f[6].empty() ? '#' : f[6][0];
+    info.bitrate = f[7];
+    info.format = f[8];
+    info.length = f[9];
+    p.releases.push_back(std::move(info));
+  }
+  return p;
+}
+
+static void run_scan(std::vector<TypeRun> &runs, const Config &cfg, const RunOptions &opt) {
+  const auto run_start = std::chrono::steady_clock::now();
+  if (g_status.enabled()) {
+    // The previous run's release count, for the ETA.
+    std::uint64_t expected = 0;
+    for (const TypeRun &run : runs) expected += load_release_count(cfg, run);
+    g_status.begin_run(expected);
+  }
+  Checkpoint ckpt(cfg, runs, opt);
+  bool resumed = false;
+  if (opt.resume) {
+    if (!ckpt.enabled()) {
+      std::cerr << "[warn] --resume needs CHECKPOINT_SECS > 0 and no --reconcile/--rebuild/--dry-run/LINK_MANIFEST; "
+                   "starting from the beginning\n";
+    } else if (!(resumed = ckpt.load())) {
+      std::cerr << "[warn] no checkpoint to resume from, starting from the beginning\n";
+    }
+  } else if (!opt.dry_run && ckpt.exists()) {
+    std::cerr << "[warn] an interrupted run left a checkpoint; --resume would continue it\n";
+  }
+
+  if (resumed) {
+    // The finished part is already linked; cleaning would throw it away.
+    if (opt.clean) std::cerr << "[resume] not cleaning\n";
+  } else if (opt.clean && opt.atomic_rebuild) {
+    for (TypeRun &run : runs) {
+      for (const auto &cat : type_categories(run)) prepare_staging(cfg.index_root / run.type, cat, opt.dry_run);
+      run.staged = true;
+    }
+  } else if (opt.clean) {
+    for (const TypeRun &run : runs) clean_type(run, cfg, opt);
+  }
+
+  IndexDirs dirs;
+  if (resumed) {
+    // Let the restored releases count towards FANOUT_THRESHOLD again.
+    for (TypeRun &run : runs) {
+      if (!run.fanout.enabled()) continue;
+      for (const auto &[key, e] : run.next_state) {
+        for_each_release_link(cfg.index_root / run.type, run.releases.get(e.release), run.indexes, false,
+                              &run.fanout, true, [](const std::string &, const std::string &, const fs::path &) {});
+      }
+      for (const std::string &dir : run.fanout.take_crossed()) fan_out_dir(dir, run.fanout, false, dirs);
+    }
+  }
+
+  // Dry runs don't go through the LinkWriter (main rejects reconcile and watch mode).
+  std::unique_ptr<LinkManifest> manifest;
+  if (!cfg.link_manifest.empty() && !opt.dry_run) {
+    manifest = std::make_unique<LinkManifest>(cfg.link_manifest, cfg.index_root);
+  }
+
+  std::vector<ScanGroup> groups = make_scan_groups(runs);
+  {
+    LinkWriter links(dirs, cfg.link_writers, manifest.get());
+    // Top-level directories not entered: finished by the interrupted run being
+    // resumed, or outside the scan window (recorded, see keep_outside_window()).
+    const ScanWindow window = make_scan_window(opt);
+    std::vector<WindowSkipped> skipped(groups.size());
+    std::vector<ParallelWalker::Skip> skips;
+    for (std::size_t i = 0; i < groups.size(); ++i) {
+      skips.push_back([&ckpt, &window, &g = groups[i], &sk = skipped[i]](const fs::path &top) {
+        if (ckpt.done(g, top.filename().string())) return true;
+        if (!window.active || g.release_depth < 2 || !window.outside(top)) return false;
+        std::lock_guard<std::mutex> lk(sk.m);
+        sk.names.insert(top.filename().string());
+        return true;
+      });
+    }
+
+    // With WALK_THREADS > 1 every root is queued for listing up front. The walker
+    // is declared last so its threads are joined before the roots go away.
+    std::vector<std::unique_ptr<ParallelWalker::Root>> listed(groups.size());
+    std::unique_ptr<ParallelWalker> walker;
+    if (cfg.walk_threads > 1) {
+      walker = std::make_unique<ParallelWalker>(cfg.walk_threads);
+      for (std::size_t i = 0; i < groups.size(); ++i) {
+        const ScanGroup &g = groups[i];
+        std::error_code ec;
+        if (ckpt.done(g) || !fs::exists(g.root, ec)) continue;
+        std::vector<const std::string *> exts;
+        for (TypeRun *t : g.types) exts.push_back(&t->ext);
+        listed[i] = walker->start(g.root, g.release_depth, std::move(exts), cfg.follow_symlinks, skips[i]);
+      }
+    }
+    for (std::size_t i = 0; i < groups.size(); ++i) {
+      ScanGroup &group = groups[i];
+      if (ckpt.done(group)) {
+        std::cerr << "[resume] skipping finished root: " << group.root << "\n";
+        continue;
+      }
+      scan_group(group, cfg, opt, dirs, links, ckpt, skips[i], listed[i].get());
+      keep_outside_window(group, skipped[i], cfg, opt, dirs);
+      ckpt.finish(group);
+      if (ckpt.due()) {
+        links.drain();
+        ckpt.write();
+      }
+    }
+    links.drain();
+  }
+
+  if (manifest) {
+    manifest->finish();
+    std::cerr << "[links] " << manifest->ops() << " link operations written to " << manifest->path() << "\n";
+    // Staged trees are swapped in below, so their links have to exist by then.
+    if (!cfg.link_apply.empty()) apply_manifest(*manifest, cfg.link_apply);
+  }
+
+  if (opt.reconcile) {
+    for (TypeRun &run : runs) {
+      if (!run.roots_complete) {
+        std::cerr << "[warn] [" << run.type << "] scan root missing or releases outside the scan window unknown, "
+                     "keeping stale links\n";
+      }
+      apply_desired_links(run, cfg, opt, dirs);
     }
   }
 
-  std::unordered_set<std::string> seen_release_dirs;
+  std::vector<fs::path> old_trees;
+  for (const TypeRun &run : runs) {
+    if (!run.staged) continue;
+    for (const auto &cat : type_categories(run)) {
+      fs::path old = swap_in_staged(cfg.index_root / run.type, cat, opt.dry_run);
+      if (!old.empty()) old_trees.push_back(std::move(old));
+    }
+  }
 
-  fs::directory_options opts = fs::directory_options::skip_permission_denied;
-  if (cfg.follow_symlinks)
-    opts |= fs::directory_options::follow_directory_symlink;
+  for (TypeRun &run : runs) {
+    // Only releases seen in this run are written back, so deleted ones drop out.
+    if (cfg.incremental) save_state(run.state_path, run.next_state, run.releases, opt.dry_run);
+    write_catalog(cfg, run, opt.dry_run);
+    save_release_count(cfg, run, opt.dry_run);
+    if (!cfg.shard.empty()) write_partial(cfg, run, opt.dry_run);
 
-  std::size_t files_seen = 0;
-  std::size_t releases_indexed = 0;
+    std::cerr << "[" << run.type << "] scanned files: " << run.files_seen
+              << ", indexed releases: " << run.releases_indexed;
+    if (cfg.incremental) std::cerr << " (unchanged, from state: " << run.releases_from_state << ")";
+    if (run.releases_outside_window) std::cerr << ", kept outside scan window: " << run.releases_outside_window;
+    std::cerr << "\n";
+  }
+  if (g_tags.enabled()) save_tag_cache(tag_cache_path(cfg), g_tags, opt.dry_run);
+  // The run is complete, so whatever checkpoint there was is obsolete.
+  if (!opt.dry_run) ckpt.remove();
+  if (const std::uint64_t failed = g_metrics.symlink_errors.load()) {
+    std::cerr << "[warn] " << failed << " links could not be written, see above\n";
+  }
+
+  write_metrics(cfg, runs, std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count());
+  g_status.set_phase("done");
+
+  // All worker threads are gone by now (required for the fork); the status
+  // reporter is stopped for it.
+  if (!old_trees.empty() && g_reporter) g_reporter->stop();
+  remove_in_background(old_trees);
+  if (g_reporter) g_reporter->start();
+}
+
+// ---- watch mode ----
+//
+// After the initial scan, inotify watches every directory above the release depth
+// of each scan root (root, date directories, ...). New, moved or deleted releases
+// there are debounced per release directory and then (re-)indexed or unindexed
+// one by one through read_release_job()/index_release(). A release that has no
+// parsable audio file yet (an upload in progress) additionally gets watches on its
+// own subtree until it resolves.
+
+#ifdef __linux__
+
+static volatile std::sig_atomic_t g_stop = 0;
+
+static void on_stop_signal(int) { g_stop = 1; }
+
+static bool same_release_info(const ReleaseInfo &a, const ReleaseInfo &b) {
+  return a.artist == b.artist && a.album == b.album && a.genre == b.genre && a.year == b.year &&
+         a.group == b.group && a.alpha == b.alpha && a.release_name == b.release_name && a.bitrate == b.bitrate &&
+         a.format == b.format && a.length == b.length;
+}
+
+// Remove the links `info` has in the index, but only those still pointing at the
+// release (a same-named release elsewhere may own the link).
+static void unindex_release(const std::string &type,
+                            const ReleaseInfo &info,
+                            const Config &cfg,
+                            CategoryMask indexes,
+                            bool dry_run,
+                            IndexDirs &dirs,
+                            FanOut *fanout) {
+  for_each_release_link(cfg.index_root / type, info, indexes, false, fanout, false,
+                        [&](const std::string &dir, const std::string &link, const fs::path &target) {
+    std::error_code ec;
+    fs::path current = fs::read_symlink(link, ec);
+    if (ec || current != dirs.link_target(target, dir, cfg.relative_symlinks)) return;
+    if (dry_run) return;
+    if (!remove_link(dirs, dir, link, ec)) {
+      std::cerr << "[warn] cannot remove link: " << fs::path(link) << " (" << ec.message() << ")\n";
+      return;
+    }
+    if (fs::is_empty(dir, ec) && !ec) {
+      dirs.forget(dir);
+      fs::remove(dir, ec);
+    }
+  });
+}
+
+class ReleaseWatcher {
+ public:
+  ReleaseWatcher(std::vector<TypeRun> &runs, const Config &cfg, const RunOptions &opt)
+      : runs_(runs), cfg_(cfg), opt_(opt), groups_(make_scan_groups(runs)),
+        fd_(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+    if (fd_ < 0) throw std::runtime_error(std::string("inotify_init1 failed: ") + std::strerror(errno));
+    for (TypeRun &run : runs_) run.keep_indexed = true;
+    for (ScanGroup &g : groups_) {
+      for (TypeRun *t : g.types) exts_[&g].push_back(&t->ext);
+      watch_containers(g, g.root, 0, false);
+    }
+  }
+
+  ReleaseWatcher(const ReleaseWatcher &) = delete;
+  ReleaseWatcher &operator=(const ReleaseWatcher &) = delete;
+  ~ReleaseWatcher() { ::close(fd_); }
+
+  // Process events until SIGINT/SIGTERM.
+  void run() {
+    using clock = std::chrono::steady_clock;
+    auto next_save = clock::now() + kStateSaveInterval;
+    // The initial scan has consumed the loaded state.
+    for (TypeRun &run : runs_) {
+      run.prev_state.clear();
+      run.prev_releases = ReleaseTable{};
+    }
+    alignas(inotify_event) char buf[64 * 1024];
+
+    while (!g_stop) {
+      int timeout = -1;
+      auto now = clock::now();
+      if (!pending_.empty()) {
+        auto due = std::min_element(pending_.begin(), pending_.end(), [](const auto &a, const auto &b) {
+          return a.second.due < b.second.due;
+        })->second.due;
+        timeout = static_cast<int>(std::max<long long>(
+            0, std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1));
+      }
+      if (state_dirty_) {
+        int until_save = static_cast<int>(std::max<long long>(
+            0, std::chrono::duration_cast<std::chrono::milliseconds>(next_save - now).count()));
+        timeout = (timeout < 0) ? until_save : std::min(timeout, until_save);
+      }
+
+      pollfd pfd{fd_, POLLIN, 0};
+      int rc = ::poll(&pfd, 1, timeout);
+      if (rc < 0 && errno != EINTR) throw std::runtime_error(std::string("poll failed: ") + std::strerror(errno));
+
+      if (rc > 0) {
+        while (true) {
+          ssize_t n = ::read(fd_, buf, sizeof(buf));
+          if (n <= 0) break;
+          for (char *p = buf; p < buf + n;) {
+            auto *ev = reinterpret_cast<inotify_event *>(p);
+            handle_event(*ev);
+            p += sizeof(inotify_event) + ev->len;
+          }
+        }
+      }
+
+      if (overflowed_) {
+        overflowed_ = false;
+        rescan();
+      }
+
+      now = clock::now();
+      std::vector<std::pair<fs::path, Pending>> due;
+      for (auto it = pending_.begin(); it != pending_.end();) {
+        if (it->second.due <= now) {
+          due.emplace_back(it->first, it->second);
+          it = pending_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      for (auto &[dir, p] : due) process(*p.group, dir, p.shallow);
+
+      if (state_dirty_ && clock::now() >= next_save) {
+        save_states();
+        next_save = clock::now() + kStateSaveInterval;
+      }
+    }
+    if (state_dirty_) save_states();
+  }
+
+ private:
+  static constexpr auto kStateSaveInterval = std::chrono::seconds(60);
+
+  static constexpr std::uint32_t kContainerMask =
+      IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR | IN_DONT_FOLLOW;
+  static constexpr std::uint32_t kReleaseMask =
+      IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+  struct Watch {
+    ScanGroup *group = nullptr;
+    fs::path dir;
+    // Levels below the group root; >= release_depth means inside a release.
+    int level = 0;
+    // Set for watches inside a release: the release they belong to.
+    fs::path release;
+  };
+
+  struct Pending {
+    ScanGroup *group = nullptr;
+    bool shallow = false;
+    std::chrono::steady_clock::time_point due;
+  };
+
+  int add_watch(ScanGroup &g, const fs::path &dir, int level, const fs::path &release) {
+    int wd = ::inotify_add_watch(fd_, dir.c_str(), release.empty() ? kContainerMask : kReleaseMask);
+    if (wd < 0) {
+      std::cerr << "[warn] cannot watch " << dir << " (" << std::strerror(errno) << ")\n";
+      return -1;
+    }
+    watches_[wd] = Watch{&g, dir, level, release};
+    return wd;
+  }
+
+  // Watch `dir` (a directory above the release depth) and everything like it below.
+  // With `mark`, the releases found are queued too (a date directory moved in).
+  void watch_containers(ScanGroup &g, const fs::path &dir, int level, bool mark) {
+    add_watch(g, dir, level, {});
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+         !ec && it != end; it.increment(ec)) {
+      std::error_code tec;
+      if (it->is_directory(tec) && (cfg_.follow_symlinks || !it->is_symlink(tec))) {
+        if (level + 1 < g.release_depth) watch_containers(g, it->path(), level + 1, mark);
+        else if (mark) mark_dirty(g, it->path(), false);
+      } else if (mark && matches(g, it->path())) {
+        mark_dirty(g, dir, true);
+      }
+    }
+  }
+
+  // Temporary watches on a release's subtree while it has no parsable file yet.
+  void watch_release(ScanGroup &g, const fs::path &release) {
+    if (release_watches_.count(release.native())) return;
+    auto &wds = release_watches_[release.native()];
+    int wd = add_watch(g, release, g.release_depth, release);
+    if (wd >= 0) wds.push_back(wd);
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(release, fs::directory_options::skip_permission_denied, ec), end;
+         it != end; it.increment(ec)) {
+      if (ec) break;
+      std::error_code tec;
+      if (!it->is_directory(tec) || it->is_symlink(tec)) continue;
+      wd = add_watch(g, it->path(), g.release_depth + it.depth() + 1, release);
+      if (wd >= 0) wds.push_back(wd);
+    }
+  }
+
+  void unwatch_release(const fs::path &release) {
+    auto it = release_watches_.find(release.native());
+    if (it == release_watches_.end()) return;
+    for (int wd : it->second) {
+      ::inotify_rm_watch(fd_, wd);
+      watches_.erase(wd);
+    }
+    release_watches_.erase(it);
+  }
+
+  bool matches(ScanGroup &g, const fs::path &p) {
+    const auto &exts = exts_[&g];
+    return std::any_of(exts.begin(), exts.end(), [&](const std::string *e) { return has_ext(p, *e); });
+  }
+
+  void mark_dirty(ScanGroup &g, const fs::path &release, bool shallow) {
+    auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(cfg_.watch_debounce_ms);
+    pending_[release] = Pending{&g, shallow, due};
+  }
+
+  void handle_event(const inotify_event &ev) {
+    if (ev.mask & IN_Q_OVERFLOW) {
+      overflowed_ = true;
+      return;
+    }
+    auto wit = watches_.find(ev.wd);
+    if (wit == watches_.end()) return;
+    if (ev.mask & IN_IGNORED) {
+      // The directory is gone (or the watch was removed).
+      if (!wit->second.release.empty()) {
+        auto &wds = release_watches_[wit->second.release.native()];
+        wds.erase(std::remove(wds.begin(), wds.end(), ev.wd), wds.end());
+      }
+      watches_.erase(wit);
+      return;
+    }
+    if (ev.len == 0) return;
+
+    const Watch w = wit->second;
+    ScanGroup &g = *w.group;
+    const fs::path child = w.dir / ev.name;
+    const bool is_dir = (ev.mask & IN_ISDIR) != 0;
+    const bool appeared = (ev.mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+    const bool vanished = (ev.mask & (IN_DELETE | IN_MOVED_FROM)) != 0;
+
+    if (!w.release.empty()) {
+      // Inside a release that is still waiting for a parsable file.
+      if (is_dir && appeared) {
+        int wd = add_watch(g, child, w.level + 1, w.release);
+        if (wd >= 0) release_watches_[w.release.native()].push_back(wd);
+        mark_dirty(g, w.release, false);
+      } else if ((is_dir && vanished) ||
+                 (!is_dir && (ev.mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)) &&
+                  matches(g, child))) {
+        // A removed file is re-checked too: without one left the release is unlinked.
+        mark_dirty(g, w.release, false);
+      }
+      return;
+    }
 
-  for (const auto &root : roots) {
+    if (is_dir) {
+      if (w.level + 1 >= g.release_depth) {
+        if (appeared || vanished) mark_dirty(g, child, false);
+      } else if (appeared) {
+        watch_containers(g, child, w.level + 1, true);
+      } else if (vanished) {
+        // A whole date directory went away: every release indexed below it.
+        const std::string prefix = child.native() + "/";
+        for (TypeRun *t : g.types) {
+          for (const auto &kv : t->indexed) {
+            if (kv.first.compare(0, prefix.size(), prefix) == 0) mark_dirty(g, kv.first, false);
+          }
+        }
+      }
+    } else if ((ev.mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)) && matches(g, child)) {
+      // Audio file directly in a directory above the release depth.
+      mark_dirty(g, w.dir, true);
+    }
+  }
+
+  void drop_release(TypeRun &t, const std::string &key) {
+    auto it = t.indexed.find(key);
+    if (it == t.indexed.end()) return;
+    unindex_release(t.type, t.releases.get(it->second), cfg_, t.indexes, opt_.dry_run, dirs_, &t.fanout);
+    t.indexed.erase(it);
+    t.seen_release_dirs.erase(key);
+    if (t.next_state.erase(key)) state_dirty_ = true;
+    std::cerr << "[" << t.type << "] removed: " << key << "\n";
+  }
+
+  void process(ScanGroup &g, const fs::path &release_dir, bool shallow) {
+    const std::string key = release_dir.string();
     std::error_code ec;
-    if (!fs::exists(root, ec)) {
-      std::cerr << "[warn] scan root does not exist: " << root << "\n";
+
+    if (!fs::is_directory(release_dir, ec)) {
+      unwatch_release(release_dir);
+      for (TypeRun *t : g.types) drop_release(*t, key);
+      return;
+    }
+
+    const std::size_t ntypes = g.types.size();
+    ReleaseJob job{release_dir, {}, shallow, cfg_.incremental, std::vector<bool>(ntypes, true), {}};
+    job.seed.release_key = g_release_keys.intern(key);
+    fs::directory_options opts = fs::directory_options::skip_permission_denied;
+    if (cfg_.follow_symlinks) opts |= fs::directory_options::follow_directory_symlink;
+    ReleaseResult r = read_release_job(job, exts_[&g], opts, cfg_);
+
+    bool resolved = false;
+    for (std::size_t i = 0; i < ntypes; ++i) {
+      TypeRun &run = *g.types[i];
+      TypeResult &t = r.types[i];
+      if (!t.info) {
+        // No matching file left (deleted or moved away).
+        drop_release(run, key);
+        continue;
+      }
+      resolved = true;
+      auto old = run.indexed.find(key);
+      if (old != run.indexed.end()) {
+        const ReleaseInfo was = run.releases.get(old->second);
+        if (same_release_info(was, *t.info)) continue;
+        unindex_release(run.type, was, cfg_, run.indexes, opt_.dry_run, dirs_, &run.fanout);
+      }
+      index_release(run.type, *t.info, cfg_, run.indexes, opt_.force, opt_.dry_run, links_, false, &run.fanout);
+      // The old row stays behind in the append-only table until the next rescan.
+      const ReleaseId row = run.releases.add(*t.info);
+      run.indexed[key] = row;
+      run.seen_release_dirs.insert(r.release_key);
+      if (!t.entry.audio_file.empty()) {
+        t.entry.release = row;
+        run.next_state[key] = std::move(t.entry);
+        state_dirty_ = true;
+      }
+      std::cerr << "[" << run.type << "] indexed: " << key << "\n";
+    }
+
+    if (resolved) unwatch_release(release_dir);
+    else if (!shallow) watch_release(g, release_dir);
+  }
+
+  // The event queue overflowed, so events were lost: re-run a (incremental) scan
+  // and pick up any directories we missed.
+  void rescan() {
+    std::cerr << "[warn] inotify queue overflow, rescanning\n";
+    RunOptions o = opt_;
+    o.clean = false;
+    o.resume = false;
+    // Events anywhere may have been lost.
+    o.window_days = 0;
+    o.since.clear();
+    std::vector<std::unordered_map<std::string, ReleaseId, StringHash, std::equal_to<>>> was_indexed;
+    for (TypeRun &run : runs_) {
+      run.prev_state = std::move(run.next_state);
+      run.prev_releases = std::move(run.releases);
+      run.prev_state_loaded = true;
+      run.next_state.clear();
+      run.releases = ReleaseTable{};
+      was_indexed.push_back(std::move(run.indexed));
+      run.indexed.clear();
+      run.seen_release_dirs.clear();
+      run.roots_complete = true;
+      run.fanout.configure(cfg_.fanout_threshold, cfg_.fanout_hash);
+      run.files_seen = run.releases_indexed = run.releases_from_state = 0;
+    }
+    run_scan(runs_, cfg_, o);
+    g_status.set_phase("watching");
+    // Releases the scan didn't find again are still linked (their removal events
+    // may be among the lost ones); keep them so a later event can unindex them.
+    for (std::size_t i = 0; i < runs_.size(); ++i) {
+      TypeRun &run = runs_[i];
+      for (const auto &[key, row] : was_indexed[i]) {
+        if (!run.indexed.count(key)) run.indexed.emplace(key, run.releases.add(run.prev_releases.get(row)));
+      }
+      run.prev_state.clear();
+      run.prev_releases = ReleaseTable{};
+    }
+    for (ScanGroup &g : groups_) watch_containers(g, g.root, 0, false);
+    state_dirty_ = false;
+  }
+
+  void save_states() {
+    if (cfg_.incremental) {
+      for (TypeRun &run : runs_) save_state(run.state_path, run.next_state, run.releases, opt_.dry_run);
+    }
+    for (TypeRun &run : runs_) write_catalog(cfg_, run, opt_.dry_run);
+    if (g_tags.enabled()) {
+      g_tags.set_today(epoch_day());
+      save_tag_cache(tag_cache_path(cfg_), g_tags, opt_.dry_run);
+    }
+    // In watch mode the counters are cumulative and run_seconds is the uptime.
+    write_metrics(cfg_, runs_, std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count());
+    state_dirty_ = false;
+  }
+
+  std::vector<TypeRun> &runs_;
+  const Config &cfg_;
+  const RunOptions &opt_;
+  std::chrono::steady_clock::time_point started_ = std::chrono::steady_clock::now();
+  std::vector<ScanGroup> groups_;
+  std::unordered_map<const ScanGroup *, std::vector<const std::string *>> exts_;
+  int fd_;
+  IndexDirs dirs_;
+  // Inline: unindex_release() works on dirs_ directly.
+  LinkWriter links_{dirs_, 1};
+  std::unordered_map<int, Watch> watches_;
+  std::unordered_map<std::string, std::vector<int>> release_watches_;
+  std::unordered_map<fs::path, Pending, std::hash<fs::path>> pending_;
+  bool overflowed_ = false;
+  bool state_dirty_ = false;
+};
+
+#endif  // __linux__
+
+// ---- query ----
+//
+// `mp3flac-indexer <config> query [--type T] [--genre G] [--year Y] ...` answers
+// multi-facet questions from the catalog (CATALOG=true) without a symlink tree
+// per facet combination: each facet is one posting list, and the lists are
+// intersected smallest first.
+
+static const char *const kCatalogFieldNames[] = {"artist", "album", "genre", "year", "group", "alpha"};
+
+// A read-only mapping of a <type>.catalog file.
+class CatalogView {
+ public:
+  explicit CatalogView(const fs::path &path) : path_(path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Cannot open catalog: " + path.string() + " (" + std::strerror(errno) + ")");
+    struct stat st {};
+    if (::fstat(fd, &st) == 0) size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ >= sizeof(CatalogHeader)) {
+      void *p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) data_ = static_cast<const char *>(p);
+    }
+    ::close(fd);
+    if (!data_) throw std::runtime_error("Cannot map catalog: " + path.string());
+
+    std::memcpy(&h_, data_, sizeof(h_));
+    if (std::memcmp(h_.magic, kCatalogMagic, sizeof(h_.magic)) == 0 && h_.version == 0x01000000u) {
+      throw std::runtime_error("Catalog was written with the other byte order, rebuild it on this host: " +
+                               path.string());
+    }
+    if (std::memcmp(h_.magic, kCatalogMagic, sizeof(h_.magic)) != 0 || h_.version != 1) {
+      throw std::runtime_error("Not a version 1 catalog: " + path.string());
+    }
+    bool ok = in_bounds(h_.releases_offset, std::uint64_t(h_.release_count) * sizeof(CatalogRelease)) &&
+              in_bounds(h_.strings_offset, h_.strings_size) && h_.postings_offset <= h_.strings_offset;
+    for (std::uint32_t f = 0; f < kCatFields; ++f) {
+      ok = ok && in_bounds(h_.values_offset[f], std::uint64_t(h_.value_count[f]) * sizeof(CatalogValue));
+    }
+    if (!ok) throw std::runtime_error("Corrupt catalog: " + path.string());
+  }
+
+  CatalogView(const CatalogView &) = delete;
+  CatalogView &operator=(const CatalogView &) = delete;
+  ~CatalogView() {
+    if (data_) ::munmap(const_cast<char *>(data_), size_);
+  }
+
+  std::uint32_t release_count() const { return h_.release_count; }
+
+  std::string_view release_path(std::uint32_t i) const {
+    const CatalogRelease r = at<CatalogRelease>(h_.releases_offset + std::uint64_t(i) * sizeof(CatalogRelease));
+    return str(r.path_offset, r.path_size);
+  }
+
+  // Posting list of `value` in `field`; empty if no release has it.
+  std::pair<const std::uint32_t *, std::size_t> postings(CatalogField field, std::string_view value) const {
+    std::size_t lo = 0, hi = h_.value_count[field];
+    while (lo < hi) {
+      std::size_t mid = lo + (hi - lo) / 2;
+      const CatalogValue v = value_at(field, mid);
+      std::string_view s = str(v.str_offset, v.str_size);
+      if (s < value) {
+        lo = mid + 1;
+      } else if (value < s) {
+        hi = mid;
+      } else {
+        std::uint64_t off = h_.postings_offset + v.postings_index * sizeof(std::uint32_t);
+        if (!in_bounds(off, std::uint64_t(v.postings_count) * sizeof(std::uint32_t))) break;
+        return {reinterpret_cast<const std::uint32_t *>(data_ + off), v.postings_count};
+      }
+    }
+    return {nullptr, 0};
+  }
+
+ private:
+  bool in_bounds(std::uint64_t off, std::uint64_t len) const { return off <= size_ && len <= size_ - off; }
+
+  template <class T>
+  T at(std::uint64_t off) const {
+    T v;
+    std::memcpy(&v, data_ + off, sizeof(T));
+    return v;
+  }
+
+  CatalogValue value_at(CatalogField field, std::size_t i) const {
+    return at<CatalogValue>(h_.values_offset[field] + i * sizeof(CatalogValue));
+  }
+
+  std::string_view str(std::uint64_t off, std::uint32_t len) const {
+    if (off > h_.strings_size || len > h_.strings_size - off) throw std::runtime_error("Corrupt catalog: " + path_.string());
+    return std::string_view(data_ + h_.strings_offset + off, len);
+  }
+
+  fs::path path_;
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+  CatalogHeader h_{};
+};
+
+// Intersection of two strictly ascending lists. Compares blocks of four against
+// all four rotations of the other block with SSE2 where available (the
+// "shuffle and compare" scheme), switching to galloping when one list is much
+// shorter than the other.
+static std::vector<std::uint32_t> intersect_sorted(const std::uint32_t *a, std::size_t na,
+                                                   const std::uint32_t *b, std::size_t nb) {
+  if (na > nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  std::vector<std::uint32_t> out;
+  out.reserve(na);
+  if (na == 0) return out;
+
+  if (nb / na >= 32) {
+    const std::uint32_t *lo = b, *end = b + nb;
+    for (std::size_t i = 0; i < na && lo != end; ++i) {
+      std::size_t step = 1;
+      const std::uint32_t *hi = lo;
+      while (hi < end && *hi < a[i]) {
+        lo = hi;
+        hi = (static_cast<std::size_t>(end - hi) > step) ? hi + step : end;
+        step *= 2;
+      }
+      lo = std::lower_bound(lo, hi == end ? end : hi + 1, a[i]);
+      if (lo != end && *lo == a[i]) out.push_back(a[i]);
+    }
+    return out;
+  }
+
+  std::size_t i = 0, j = 0;
+#if defined(__SSE2__)
+  while (i + 4 <= na && j + 4 <= nb) {
+    const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+    __m128i eq = _mm_cmpeq_epi32(va, vb);
+    eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+    eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+    eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+    for (int mask = _mm_movemask_ps(_mm_castsi128_ps(eq)); mask; mask &= mask - 1) {
+      out.push_back(a[i + static_cast<std::size_t>(__builtin_ctz(static_cast<unsigned>(mask)))]);
+    }
+    const std::uint32_t amax = a[i + 3], bmax = b[j + 3];
+    if (amax <= bmax) i += 4;
+    if (bmax <= amax) j += 4;
+  }
+#endif
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) ++i;
+    else if (b[j] < a[i]) ++j;
+    else {
+      out.push_back(a[i]);
+      ++i;
+      ++j;
+    }
+  }
+  return out;
+}
+
+static int run_query(const fs::path &cfg_path, int argc, char **argv) {
+  std::vector<std::string> types;
+  std::vector<std::pair<CatalogField, std::string>> facets;
+  bool count_only = false;
+  std::size_t limit = 0;
+  for (int i = 3; i < argc; ++i) {
+    std::string a = argv[i];
+    auto next = [&]() -> std::string {
+      if (i + 1 >= argc) throw std::runtime_error("query: missing value for " + a);
+      return argv[++i];
+    };
+    auto field = std::find_if(std::begin(kCatalogFieldNames), std::end(kCatalogFieldNames),
+                              [&](const char *n) { return a == std::string("--") + n; });
+    if (field != std::end(kCatalogFieldNames)) {
+      facets.emplace_back(static_cast<CatalogField>(field - std::begin(kCatalogFieldNames)), next());
+    } else if (a == "--groups") {
+      facets.emplace_back(kCatGroup, next());
+    } else if (a == "--type") {
+      types.push_back(to_lower(next()));
+    } else if (a == "--count") {
+      count_only = true;
+    } else if (a == "--limit") {
+      limit = std::stoul(next());
+    } else {
+      throw std::runtime_error("query: unknown option " + a);
+    }
+  }
+
+  Config cfg = load_config(cfg_path);
+  if (types.empty()) types = cfg.enable_types;
+
+  for (const std::string &type : types) {
+    CatalogView cat(catalog_path(cfg, type));
+
+    std::vector<std::pair<const std::uint32_t *, std::size_t>> lists;
+    for (const auto &[f, value] : facets) lists.push_back(cat.postings(f, value));
+    std::sort(lists.begin(), lists.end(), [](const auto &x, const auto &y) { return x.second < y.second; });
+
+    std::vector<std::uint32_t> hits;
+    if (lists.empty()) {
+      hits.resize(cat.release_count());
+      for (std::uint32_t r = 0; r < cat.release_count(); ++r) hits[r] = r;
+    } else {
+      hits.assign(lists[0].first, lists[0].first + lists[0].second);
+      for (std::size_t l = 1; l < lists.size() && !hits.empty(); ++l) {
+        hits = intersect_sorted(hits.data(), hits.size(), lists[l].first, lists[l].second);
+      }
+    }
+
+    if (count_only) {
+      std::cout << type << "\t" << hits.size() << "\n";
       continue;
     }
+    std::size_t n = (limit && limit < hits.size()) ? limit : hits.size();
+    for (std::size_t k = 0; k < n; ++k) {
+      if (hits[k] < cat.release_count()) std::cout << cat.release_path(hits[k]) << "\n";
+    }
+  }
+  return 0;
+}
+
+// ---- merge ----
+//
+// `<config> merge [--dry-run] [--force] PARTIAL...` on the index host. Releases
+// are taken in the order of the partials on the command line; a release name seen
+// before (the same release on two nodes, or two releases sharing a name) is
+// skipped, or replaces the earlier one with --force. The union is reconciled into
+// the index, so a repeated merge only writes what changed and releases no partial
+// lists any more lose their links. Types none of the partials cover are left alone.
+
+static int run_merge(const fs::path &cfg_path, int argc, char **argv) {
+  RunOptions opt;
+  opt.reconcile = true;
+  opt.full_rescan = true;  // no state on the index host
+  std::vector<fs::path> paths;
+  for (int i = 3; i < argc; ++i) {
+    std::string a = argv[i];
+    if (a == "--dry-run") opt.dry_run = true;
+    else if (a == "--force") opt.force = true;
+    else if (!a.empty() && a[0] == '-') throw std::runtime_error("merge: unknown option " + a);
+    else paths.emplace_back(a);
+  }
+  if (paths.empty()) throw std::runtime_error("merge: no partials given");
+
+  Config cfg = load_config(cfg_path);
+  if (!cfg.shard.empty()) throw std::runtime_error("merge runs on the index host, its config must not set SHARD");
+  std::unordered_set<std::string> enabled(cfg.enable_types.begin(), cfg.enable_types.end());
+
+  struct Merged {
+    TypeRun run;
+    std::vector<ReleaseInfo> releases;
+    std::unordered_map<std::string, std::size_t> by_name;
+    std::size_t partials = 0;
+    std::size_t duplicates = 0;
+  };
+  std::vector<Merged> merged;
+  for (const MediaTypeInfo &m : kMediaTypes) {
+    if (!enabled.count(m.name)) continue;
+    merged.push_back(Merged{make_type_run(m, cfg, m.media == MediaType::Mp3 ? cfg.mp3_indexes : cfg.flac_indexes, opt),
+                            {}, {}, 0, 0});
+  }
 
-    for (fs::recursive_directory_iterator it(root, opts, ec), end; it != end; it.increment(ec)) {
-      if (ec) {
-        ec.clear();
+  for (const fs::path &path : paths) {
+    Partial p = load_partial(path);
+    auto it = std::find_if(merged.begin(), merged.end(), [&](const Merged &m) { return m.run.type == p.type; });
+    if (it == merged.end()) {
+      std::cerr << "[warn] " << path << ": type " << p.type << " is not enabled, skipped\n";
+      continue;
+    }
+    ++it->partials;
+    for (ReleaseInfo &info : p.releases) {
+      auto [pos, inserted] = it->by_name.emplace(info.release_name, it->releases.size());
+      if (inserted) {
+        it->releases.push_back(std::move(info));
         continue;
       }
-      const fs::directory_entry &ent = *it;
-      if (!ent.is_regular_file(ec)) continue;
-      const fs::path &p = ent.path();
-      if (!has_ext(p, ext)) continue;
+      ++it->duplicates;
+      if (opt.force) it->releases[pos->second] = std::move(info);
+    }
+  }
+
+  IndexDirs dirs;
+  for (Merged &m : merged) {
+    if (m.partials == 0) continue;
+    for (const ReleaseInfo &info : m.releases) {
+      m.run.releases.add(info);
+      want_release_links(m.run, info, cfg, opt, dirs);
+    }
+    std::cerr << "[" << m.run.type << "] merged " << m.releases.size() << " releases from " << m.partials
+              << " partials, duplicate names " << (opt.force ? "replaced" : "skipped") << ": " << m.duplicates << "\n";
+    apply_desired_links(m.run, cfg, opt, dirs);
+    write_catalog(cfg, m.run, opt.dry_run);
+  }
+  return g_metrics.symlink_errors.load() ? 1 : 0;
+}
+
+// ---- apply-links ----
+//
+// `mp3flac-indexer apply-links INDEX_ROOT [MANIFEST|-]` creates the links of a
+// LINK_MANIFEST (default: read from stdin) below INDEX_ROOT, on the host that
+// has it locally. Entries that would leave INDEX_ROOT are refused.
+
+static int run_apply_links(int argc, char **argv) {
+  if (argc < 3) throw std::runtime_error("apply-links: INDEX_ROOT is required");
+  const std::string root = normal_dir(argv[2]).native();
+  std::ifstream file;
+  std::istream *in = &std::cin;
+  if (argc > 3 && std::string(argv[3]) != "-") {
+    file.open(argv[3]);
+    if (!file) throw std::runtime_error("apply-links: cannot open " + std::string(argv[3]));
+    in = &file;
+  }
+
+  std::string line;
+  if (!std::getline(*in, line) || line != kManifestHeader) {
+    throw std::runtime_error("apply-links: not a link manifest");
+  }
+  IndexDirs dirs;
+  std::uint64_t bad = 0;
+  while (std::getline(*in, line)) {
+    auto f = split_tabs(line);
+    const fs::path rel = f.size() == 3 ? fs::path(state_unescape(f[1])).lexically_normal() : fs::path{};
+    if (rel.empty() || rel.is_absolute() || *rel.begin() == ".." || (f[0] != "R" && f[0] != "K")) {
+      ++bad;
+      continue;
+    }
+    const std::string link = root + "/" + rel.native();
+    const std::string dir = parent_of(link);
+    try {
+      dirs.ensure(dir, false);
+      (void)put_symlink(dirs, state_unescape(f[2]), dir, link, f[0] == "R");
+    } catch (const std::runtime_error &e) {
+      link_error(e);
+    }
+  }
+
+  const std::uint64_t failed = g_metrics.symlink_errors.load();
+  std::cerr << "[apply-links] created: " << g_metrics.symlinks_created.load()
+            << ", kept: " << g_metrics.symlinks_kept.load() << ", failed: " << failed;
+  if (bad) std::cerr << ", malformed lines: " << bad;
+  std::cerr << "\n";
+  return failed || bad ? 1 : 0;
+}
+
+// ---- bench ----
+//
+// `mp3flac-indexer bench [options]` generates a synthetic release tree (minimal
+// but valid ID3v2 / FLAC tags), then times the pipeline stages one by one: walking
+// release directories, resolving release keys, reading tags and creating links,
+// followed by a full end-to-end scan. The tree is freshly written, so tag reads
+// are served from the page cache.
 
-      ++files_seen;
-      fs::path release_dir = compute_release_dir(root, p, release_depth);
-      std::string release_key = fs::absolute(release_dir, ec).string();
-      if (!ec && seen_release_dirs.count(release_key)) continue;
+struct BenchOptions {
+  std::size_t releases = 1000;
+  int depth = 2;
+  int discs = 2;
+  int tracks = 10;
+  int flac_percent = 50;
+  unsigned threads = 0;
+  unsigned link_writers = 1;
+  unsigned walk_threads = 1;
+  bool fast_tags = true;
+  bool relative = false;
+  fs::path dir;
+  bool keep = false;
+};
+
+// Counts the syscalls the process makes: all of them through the
+// raw_syscalls:sys_enter tracepoint when perf allows it, otherwise only the
+// read/write-class ones from /proc/self/io. Threads started after construction
+// are included once they have exited.
+class SyscallCounter {
+ public:
+  SyscallCounter() {
+#ifdef __linux__
+    for (const char *p : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                          "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"}) {
+      std::ifstream in(p);
+      std::uint64_t id = 0;
+      if (!(in >> id)) continue;
+      perf_event_attr attr {};
+      attr.type = PERF_TYPE_TRACEPOINT;
+      attr.size = sizeof(attr);
+      attr.config = id;
+      attr.inherit = 1;
+      fd_ = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+      if (fd_ >= 0) break;
+    }
+#endif
+  }
+  SyscallCounter(const SyscallCounter &) = delete;
+  SyscallCounter &operator=(const SyscallCounter &) = delete;
+  ~SyscallCounter() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  const char *what() const { return fd_ >= 0 ? "syscalls" : "read/write syscalls"; }
+
+  std::uint64_t read() const {
+    if (fd_ >= 0) {
+      std::uint64_t v = 0;
+      return ::read(fd_, &v, sizeof(v)) == sizeof(v) ? v : 0;
+    }
+    std::ifstream in("/proc/self/io");
+    std::string key;
+    std::uint64_t v = 0, total = 0;
+    while (in >> key >> v) {
+      if (key == "syscr:" || key == "syscw:") total += v;
+    }
+    return total;
+  }
+
+ private:
+  int fd_ = -1;
+};
+
+static void write_file(const fs::path &p, const std::string &data) {
+  std::ofstream out(p, std::ios::binary | std::ios::trunc);
+  out.write(data.data(), static_cast<std::streamsize>(data.size()));
+  if (!out) throw std::runtime_error("Cannot write bench file: " + p.string());
+}
+
+static std::string be_bytes(std::uint32_t v, int n) {
+  std::string s;
+  for (int i = n - 1; i >= 0; --i) s.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+  return s;
+}
+
+static std::string le32_bytes(std::uint32_t v) {
+  std::string s;
+  for (int i = 0; i < 4; ++i) s.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+  return s;
+}
+
+// ID3v2.3 tag with latin-1 text frames followed by one silent MPEG-1 Layer III frame.
+static std::string synthetic_mp3(const TagFields &t) {
+  auto frame = [](const char *id, const std::string &text) {
+    std::string body = std::string(1, '\0') + text;
+    return std::string(id, 4) + be_bytes(static_cast<std::uint32_t>(body.size()), 4) + std::string(2, '\0') + body;
+  };
+  std::string frames = frame("TPE1", t.artist) + frame("TALB", t.album) + frame("TCON", t.genre) +
+                       frame("TYER", std::to_string(t.year)) + std::string(256, '\0');
+  const auto n = static_cast<std::uint32_t>(frames.size());
+  std::string size;
+  for (int shift : {21, 14, 7, 0}) size.push_back(static_cast<char>((n >> shift) & 0x7F));
+  std::string mpeg = "\xFF\xFB\x90\x64" + std::string(413, '\0');
+  return std::string("ID3\x03\x00\x00", 6) + size + frames + mpeg;
+}
+
+// "fLaC", a STREAMINFO block (44.1 kHz, 16 bit, stereo) and a VORBIS_COMMENT block.
+static std::string synthetic_flac(const TagFields &t) {
+  std::string info;
+  info += be_bytes(4096, 2) + be_bytes(4096, 2) + be_bytes(0, 3) + be_bytes(0, 3);
+  // 20 bits sample rate, 3 bits channels-1, 5 bits bps-1, 36 bits total samples.
+  std::uint64_t packed = (std::uint64_t(44100) << 44) | (std::uint64_t(1) << 41) | (std::uint64_t(15) << 36);
+  for (int i = 7; i >= 0; --i) info.push_back(static_cast<char>((packed >> (8 * i)) & 0xFF));
+  info += std::string(16, '\0');
+
+  const std::string vendor = "mp3flac-indexer bench";
+  std::vector<std::string> fields = {"ARTIST=" + t.artist, "ALBUM=" + t.album, "GENRE=" + t.genre,
+                                     "DATE=" + std::to_string(t.year)};
+  std::string vc = le32_bytes(static_cast<std::uint32_t>(vendor.size())) + vendor +
+                   le32_bytes(static_cast<std::uint32_t>(fields.size()));
+  for (const auto &f : fields) vc += le32_bytes(static_cast<std::uint32_t>(f.size())) + f;
+
+  return "fLaC" + std::string(1, '\x00') + be_bytes(static_cast<std::uint32_t>(info.size()), 3) + info +
+         std::string(1, '\x84') + be_bytes(static_cast<std::uint32_t>(vc.size()), 3) + vc;
+}
+
+// Root for type-less scans: <dir>/music/[YYYY-MM-DD/...]<release>/[CDn/]NN.ext
+static std::size_t generate_bench_tree(const BenchOptions &o, const fs::path &root) {
+  static const char *const genres[] = {"Techno", "House", "Trance", "Hip-Hop", "Rock", "Jazz", "Ambient"};
+  static const char *const groups[] = {"GRP", "XYZ", "FTD", "WEB", "BPM", "KLN", "DMT", "SRC"};
+  std::size_t files = 0;
+  for (std::size_t r = 0; r < o.releases; ++r) {
+    const bool flac = static_cast<int>(r % 100) < o.flac_percent;
+    TagFields t;
+    t.artist = "Artist " + std::to_string(r % 997);
+    t.album = "Album " + std::to_string(r);
+    t.genre = genres[r % (sizeof(genres) / sizeof(genres[0]))];
+    t.year = 1990 + static_cast<unsigned>(r % 35);
+    const std::string name = "Artist_" + std::to_string(r % 997) + "-Album_" + std::to_string(r) + "-" +
+                             (flac ? "FLAC-" : "") + std::to_string(t.year) + "-" +
+                             groups[r % (sizeof(groups) / sizeof(groups[0]))];
+
+    fs::path rel = root;
+    for (int level = 1; level < o.depth; ++level) {
+      char date[16];
+      std::snprintf(date, sizeof(date), "2020-%02d-%02d", static_cast<int>(1 + (r / 28) % 12),
+                    static_cast<int>(1 + r % 28));
+      rel /= (level == 1) ? std::string(date) : "d" + std::to_string(level);
+    }
+    rel /= name;
+
+    const std::string data = flac ? synthetic_flac(t) : synthetic_mp3(t);
+    for (int d = 1; d <= std::max(o.discs, 1); ++d) {
+      fs::path disc = (o.discs > 1) ? rel / ("CD" + std::to_string(d)) : rel;
+      fs::create_directories(disc);
+      for (int k = 1; k <= o.tracks; ++k) {
+        char fname[32];
+        std::snprintf(fname, sizeof(fname), "%02d-track.%s", k, flac ? "flac" : "mp3");
+        write_file(disc / fname, data);
+        ++files;
+      }
+    }
+  }
+  return files;
+}
+
+struct BenchStage {
+  std::string name;
+  std::size_t releases = 0;
+  double seconds = 0;
+  std::uint64_t syscalls = 0;
+};
+
+template <class Fn>
+static BenchStage time_stage(const std::string &name, const SyscallCounter &sc, Fn &&fn) {
+  BenchStage st;
+  st.name = name;
+  std::uint64_t sc0 = sc.read();
+  auto t0 = std::chrono::steady_clock::now();
+  st.releases = fn();
+  st.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  st.syscalls = sc.read() - sc0;
+  return st;
+}
+
+static int run_bench(int argc, char **argv) {
+  BenchOptions o;
+  o.threads = hardware_threads();
+  for (int i = 2; i < argc; ++i) {
+    std::string a = argv[i];
+    auto next = [&]() -> std::string {
+      if (i + 1 >= argc) throw std::runtime_error("bench: missing value for " + a);
+      return argv[++i];
+    };
+    if (a == "--releases") o.releases = std::stoul(next());
+    else if (a == "--depth") o.depth = std::max(1, std::stoi(next()));
+    else if (a == "--discs") o.discs = std::max(1, std::stoi(next()));
+    else if (a == "--tracks") o.tracks = std::max(1, std::stoi(next()));
+    else if (a == "--flac-percent") o.flac_percent = std::clamp(std::stoi(next()), 0, 100);
+    else if (a == "--threads") o.threads = static_cast<unsigned>(std::max(1, std::stoi(next())));
+    else if (a == "--link-writers") o.link_writers = static_cast<unsigned>(std::max(1, std::stoi(next())));
+    else if (a == "--walk-threads") o.walk_threads = static_cast<unsigned>(std::max(1, std::stoi(next())));
+    else if (a == "--no-fast-tags") o.fast_tags = false;
+    else if (a == "--relative") o.relative = true;
+    else if (a == "--dir") o.dir = next();
+    else if (a == "--keep") o.keep = true;
+    else throw std::runtime_error("bench: unknown option " + a);
+  }
+  if (o.dir.empty()) o.dir = fs::temp_directory_path() / ("mp3flac-bench-" + std::to_string(::getpid()));
+  if (fs::exists(o.dir) && !fs::is_empty(o.dir)) {
+    throw std::runtime_error("bench: directory is not empty: " + o.dir.string());
+  }
+
+  const fs::path root = o.dir / "music";
+  auto t0 = std::chrono::steady_clock::now();
+  std::size_t files = generate_bench_tree(o, root);
+  double gen_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::cout << "generated " << o.releases << " releases, " << files << " files (depth " << o.depth << ", "
+            << o.discs << " disc(s) x " << o.tracks << " tracks, " << o.flac_percent << "% flac) in "
+            << gen_s << " s under " << o.dir << "\n";
+
+  Config cfg;
+  cfg.music_dirs = {root};
+  cfg.index_root = o.dir / "index";
+  cfg.mp3_release_depth = cfg.flac_release_depth = o.depth;
+  cfg.threads = o.threads;
+  cfg.link_writers = o.link_writers;
+  cfg.walk_threads = o.walk_threads;
+  cfg.fast_tags = o.fast_tags;
+  cfg.relative_symlinks = o.relative;
+
+  const std::string mp3_ext = ".mp3", flac_ext = ".flac";
+  const std::vector<const std::string *> exts = {&mp3_ext, &flac_ext};
+  const fs::directory_options opts = fs::directory_options::skip_permission_denied;
+
+  // Counter first, so the worker threads below are counted.
+  SyscallCounter sc;
+  std::vector<BenchStage> stages;
+
+  struct Found {
+    fs::path dir;
+    fs::path first;
+    bool shallow;
+  };
+  std::vector<Found> found;
+  stages.push_back(time_stage("walk", sc, [&] {
+    auto add = [&](const fs::path &d, const fs::path &f, bool sh) { found.push_back({d, f, sh}); };
+    if (cfg.walk_threads > 1) {
+      ParallelWalker walker(cfg.walk_threads);
+      walker.start(root, o.depth, exts, false, nullptr)->walk(add);
+    } else {
+      walk_releases(root, 0, o.depth, exts, false, add, [](const fs::path &) { return false; });
+    }
+    return found.size();
+  }));
 
-      auto info_opt = read_release_info(p, release_dir);
-      if (!info_opt) continue;
+  std::vector<std::string> keys;
+  stages.push_back(time_stage("resolve release", sc, [&] {
+    std::unordered_set<std::string> seen;
+    for (const auto &f : found) {
+      std::error_code ec;
+      std::string key = fs::absolute(f.dir, ec).string();
+      if (!ec && seen.insert(key).second) keys.push_back(std::move(key));
+    }
+    return keys.size();
+  }));
 
-      if (!ec) seen_release_dirs.insert(release_key);
+  std::vector<std::pair<std::size_t, ReleaseInfo>> infos;
+  stages.push_back(time_stage("read tags", sc, [&] {
+    OrderedPool<ReleaseJob, ReleaseResult> pool(
+        cfg.threads, static_cast<std::size_t>(cfg.threads) * 4,
+        [&](const ReleaseJob &job) { return read_release_job(job, exts, opts, cfg); });
+    auto sink = [&](ReleaseResult r) {
+      for (std::size_t i = 0; i < r.types.size(); ++i) {
+        if (r.types[i].info) infos.emplace_back(i, std::move(*r.types[i].info));
+      }
+    };
+    for (const auto &f : found) pool.submit(ReleaseJob{f.dir, f.first, f.shallow, false, {true, true}, {}}, sink);
+    pool.drain(sink);
+    return infos.size();
+  }));
 
-      index_release(type, *info_opt, cfg, indexes, force, dry_run);
-      ++releases_indexed;
+  const CategoryMask indexes = cfg.mp3_indexes;
+  stages.push_back(time_stage("index links", sc, [&] {
+    IndexDirs dirs;
+    LinkWriter links(dirs, cfg.link_writers);
+    for (const auto &[type, info] : infos) {
+      index_release(kMediaTypes[type].name, info, cfg, indexes, false, false, links);
     }
+    links.drain();
+    return infos.size();
+  }));
+
+  fs::remove_all(cfg.index_root);
+  stages.push_back(time_stage("full scan", sc, [&] {
+    RunOptions ropt;
+    std::vector<TypeRun> runs;
+    for (const MediaTypeInfo &m : kMediaTypes) runs.push_back(make_type_run(m, cfg, indexes, ropt));
+    run_scan(runs, cfg, ropt);
+    return runs[0].releases_indexed + runs[1].releases_indexed;
+  }));
+
+  std::cout << "threads: " << cfg.threads << ", link writers: " << cfg.link_writers
+            << ", walk threads: " << cfg.walk_threads << ", fast tags: " << (cfg.fast_tags ? "on" : "off")
+            << ", counting " << sc.what() << "\n\n";
+  std::printf("%-16s %10s %10s %12s %18s\n", "stage", "releases", "seconds", "releases/s", "syscalls/release");
+  for (const auto &st : stages) {
+    double rate = st.seconds > 0 ? static_cast<double>(st.releases) / st.seconds : 0.0;
+    double per = st.releases ? static_cast<double>(st.syscalls) / static_cast<double>(st.releases) : 0.0;
+    std::printf("%-16s %10zu %10.3f %12.0f %18.1f\n", st.name.c_str(), st.releases, st.seconds, rate, per);
   }
+  std::fflush(stdout);
 
-  std::cerr << "[" << type << "] scanned files: " << files_seen << ", indexed releases: " << releases_indexed << "\n";
+  if (!o.keep) {
+    std::error_code ec;
+    fs::remove_all(o.dir, ec);
+  }
+  return 0;
 }
 
 static void print_usage(const char *argv0) {
   std::cerr
-    << "Usage: " << argv0 << " <config> [--dry-run] [--force] [--clean]\n"
+    << "Usage: " << argv0 << " <config> [--dry-run] [--force] [--clean] [--rebuild] [--reconcile] [--full] [--resume]\n"
+    << "             [--since YYYY-MM-DD] [--watch]\n"
+    << "       " << argv0 << " bench [--releases N] [--depth N] [--discs N] [--tracks N] [--flac-percent P]\n"
+    << "             [--threads N] [--link-writers N] [--walk-threads N] [--no-fast-tags] [--relative]\n"
+    << "             [--dir PATH] [--keep]\n"
+    << "       " << argv0 << " <config> query [--type mp3|flac] [--genre G] [--year Y] [--group G] [--artist A]\n"
+    << "             [--album A] [--alpha C] [--count] [--limit N]   (needs CATALOG=true)\n"
+    << "       " << argv0 << " apply-links INDEX_ROOT [MANIFEST|-]   (create the links of a LINK_MANIFEST)\n"
+    << "       " << argv0 << " <config> merge [--dry-run] [--force] PARTIAL...   (index the partials of SHARD nodes)\n"
     << "\nConfig keys:\n"
     << "  MUSIC_DIR=/path (repeatable, fallback for both types)\n"
     << "  MP3_DIR=/path (repeatable, preferred for mp3)\n"
@@ -442,10 +6175,34 @@ static void print_usage(const char *argv0) {
     << "  FLAC_INDEXES=alpha,genre,groups,year\n"
     << "  MP3_RELEASE_DEPTH=1 (example: root/YYYY-MM-DD/<release>/... => 2)\n"
     << "  FLAC_RELEASE_DEPTH=1 (example: root/YYYY-MM-DD/<release>/... => 2)\n"
-    << "  (Also supported index names: artist, album)\n"
+    << "  (Also supported index names: artist, album, bitrate, format, length)\n"
     << "  RELATIVE_SYMLINKS=true|false\n"
     << "  CLEAN_ON_START=true|false\n"
-    << "  FOLLOW_SYMLINKS=true|false\n";
+    << "  ATOMIC_REBUILD=true|false\n"
+    << "  RECONCILE=true|false\n"
+    << "  CATALOG=true|false\n"
+    << "  FANOUT_THRESHOLD=0 (split value dirs above N releases into buckets)\n"
+    << "  FANOUT=alpha|hash\n"
+    << "  FOLLOW_SYMLINKS=true|false\n"
+    << "  INCREMENTAL=true|false\n"
+    << "  CHECKPOINT_SECS=60 (0 = no checkpoints, see --resume)\n"
+    << "  SCAN_WINDOW_DAYS=0 (only walk date directories of the last N days)\n"
+    << "  THREADS=N (default: hardware threads)\n"
+    << "  WALK_THREADS=N (directory listing threads, default 1)\n"
+    << "  LINK_WRITERS=N (symlink writer threads, default 1)\n"
+    << "  LINK_MANIFEST=/path, LINK_APPLY=command (batch links for a remote index)\n"
+    << "  SHARD=name, SHARD_PATH_MAP=/local=/index/host/path (scan only, write partials for merge)\n"
+    << "  FAST_TAGS=true|false\n"
+    << "  TAG_SAMPLES=1 (tracks per release voting on the tags)\n"
+    << "  TAG_CACHE=true|false (tags by file identity, survives moves; default false)\n"
+    << "  METRICS_JSON=/path (JSON run summary)\n"
+    << "  METRICS_PROM=/path (Prometheus textfile)\n"
+    << "  STATUS_JSON=/path, STATUS_SECS=2 (progress file rewritten while running)\n"
+    << "  TAG_READ_IOPS=N, TAG_READ_BYTES=N[K|M|G] (per second, default unlimited)\n"
+    << "  TAG_READ_LATENCY_MS=N (fewer readers above this per-file read time)\n"
+    << "  IOPRIO_IDLE=true|false (idle I/O class for tag readers)\n"
+    << "  PREFETCH_DISTANCE=0, PREFETCH_KB=64 (prefetch tag areas N releases ahead)\n"
+    << "  WATCH_DEBOUNCE_MS=1000\n";
 }
 
 int main(int argc, char **argv) {
@@ -455,19 +6212,30 @@ int main(int argc, char **argv) {
       return 2;
     }
 
+    if (std::string(argv[1]) == "bench") return run_bench(argc, argv);
+    if (std::string(argv[1]) == "apply-links") return run_apply_links(argc, argv);
+    if (argc >= 3 && std::string(argv[2]) == "query") return run_query(argv[1], argc, argv);
+    if (argc >= 3 && std::string(argv[2]) == "merge") return run_merge(argv[1], argc, argv);
+
     fs::path cfg_path = argv[1];
 
-    bool dry_run = false;
-    bool force = false;
+    RunOptions opt;
+    bool watch = false;
     bool clean_override = false;
     bool clean_flag = false;
 
     for (int i = 2; i < argc; ++i) {
       std::string a = argv[i];
-      if (a == "--dry-run") dry_run = true;
-      else if (a == "--force") force = true;
+      if (a == "--dry-run") opt.dry_run = true;
+      else if (a == "--force") opt.force = true;
+      else if (a == "--full") opt.full_rescan = true;
+      else if (a == "--resume") opt.resume = true;
+      else if (a == "--since" && i + 1 < argc) opt.since = argv[++i];
+      else if (a == "--reconcile") opt.reconcile = true;
+      else if (a == "--watch") watch = true;
       else if (a == "--clean") { clean_override = true; clean_flag = true; }
       else if (a == "--no-clean") { clean_override = true; clean_flag = false; }
+      else if (a == "--rebuild") { clean_override = true; clean_flag = true; opt.atomic_rebuild = true; }
       else if (a == "--help" || a == "-h") { print_usage(argv[0]); return 0; }
       else {
         std::cerr << "Unknown arg: " << a << "\n";
@@ -477,18 +6245,69 @@ int main(int argc, char **argv) {
     }
 
     Config cfg = load_config(cfg_path);
+#ifndef __linux__
+    if (watch) throw std::runtime_error("--watch needs inotify (Linux only)");
+#endif
 
-    bool clean = clean_override ? clean_flag : cfg.clean_on_start;
+    opt.clean = clean_override ? clean_flag : cfg.clean_on_start;
+    opt.atomic_rebuild = opt.atomic_rebuild || cfg.atomic_rebuild;
+    opt.reconcile = opt.reconcile || cfg.reconcile;
+    opt.window_days = cfg.scan_window_days;
+    if (!cfg.shard.empty()) {
+      if (watch) throw std::runtime_error("--watch cannot be used with SHARD (partials are written after a run)");
+      // Nothing is linked on a shard node; the index host cleans or reconciles on merge.
+      opt.clean = opt.atomic_rebuild = opt.reconcile = false;
+    }
+    if (opt.clean && opt.atomic_rebuild && !cfg.link_manifest.empty() && cfg.link_apply.empty() && !opt.dry_run) {
+      throw std::runtime_error("--rebuild with LINK_MANIFEST needs LINK_APPLY (the rebuilt tree is swapped in after "
+                               "its links are applied)");
+    }
+    // Both would change INDEX_ROOT directly instead of through the manifest.
+    if (!cfg.link_manifest.empty() && !opt.dry_run && (opt.reconcile || watch)) {
+      throw std::runtime_error(std::string(watch ? "--watch" : "--reconcile") +
+                               " cannot be used with LINK_MANIFEST (it would write links directly under INDEX_ROOT)");
+    }
+    g_io.configure(cfg.threads, cfg.tag_read_iops, static_cast<double>(cfg.tag_read_bytes), cfg.tag_read_latency_ms,
+                   cfg.ioprio_idle);
+    if (cfg.prefetch_distance > 0 && g_io.rate_limited()) {
+      std::cerr << "[warn] PREFETCH_DISTANCE is ignored with TAG_READ_IOPS/TAG_READ_BYTES\n";
+    }
+    if (cfg.tag_cache) {
+      g_tags.enable(true);
+      g_tags.set_today(epoch_day());
+      load_tag_cache(tag_cache_path(cfg), g_tags);
+    }
 
     std::unordered_set<std::string> enabled(cfg.enable_types.begin(), cfg.enable_types.end());
 
-    if (enabled.count("mp3")) {
-      run_for_type("mp3", cfg, cfg.mp3_indexes, force, clean, dry_run);
+    std::vector<TypeRun> runs;
+    for (const MediaTypeInfo &m : kMediaTypes) {
+      if (!enabled.count(m.name)) continue;
+      runs.push_back(make_type_run(m, cfg, m.media == MediaType::Mp3 ? cfg.mp3_indexes : cfg.flac_indexes, opt));
     }
-    if (enabled.count("flac")) {
-      run_for_type("flac", cfg, cfg.flac_indexes, force, clean, dry_run);
+
+    StatusReporter status(cfg);
+    g_reporter = &status;
+    if (!watch) {
+      run_scan(runs, cfg, opt);
+      // Links that failed were counted and reported; exit non-zero so cron notices.
+      return g_metrics.symlink_errors.load() ? 1 : 0;
     }
 
+#ifdef __linux__
+    struct sigaction sa {};
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    ::sigaction(SIGINT, &sa, nullptr);
+    ::sigaction(SIGTERM, &sa, nullptr);
+
+    // Watches go up before the initial scan so nothing that changes during it is missed.
+    ReleaseWatcher watcher(runs, cfg, opt);
+    run_scan(runs, cfg, opt);
+    g_status.set_phase("watching");
+    std::cerr << "[watch] initial scan done, watching for changes\n";
+    watcher.run();
+#endif
     return 0;
   } catch (const std::exception &e) {
     std::cerr << "error: " << e.what() << "\n";